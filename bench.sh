@@ -0,0 +1,77 @@
+#!/bin/sh
+# end-to-end benchmark, prints one JSON line per sample and mode
+# usage: bench.sh [corpus dir] (samples are <name>.pbm- files as used by test-encode.sh)
+# all samples must exist, the ones below that are missing are derived from others by pbmsample
+
+DIR=${1:-.}
+RUNS=${RUNS:-3}
+PPD_CANON=ppd/mf5730.ppd
+PPD_G4=ppd/l120.ppd
+
+# sample, dpi, paper size
+SAMPLES="
+oneline 600 A4
+web1 600 A4
+web1-300 300 A4
+testpage 600 A4
+testpage-legal 600 Legal
+screenshot 600 A4
+screenshot-legal 600 Legal
+sunset-dither 600 A4
+waterlilies-dither 600 A4
+bluehills-dither 600 A4
+sunset 600 A4
+waterlilies 600 A4
+bluehills 600 A4
+"
+
+# sample, source sample, pbmsample arguments (300 dpi or Legal page at 600 dpi)
+DERIVED="
+web1-300 web1 half
+testpage-legal testpage 4863 8163
+screenshot-legal screenshot 4863 8163
+"
+
+# corpus file, or derived one in the current directory
+sample() {
+	if [ -f $DIR/$1.pbm- ]; then
+		echo $DIR/$1.pbm-
+	else
+		echo $1.pbm-
+	fi
+}
+
+echo "$DERIVED" | while read name src args; do
+	[ -z "$name" ] && continue
+	if [ ! -f $(sample $name) ] && [ -f $DIR/$src.pbm- ]; then
+		./pbmsample $DIR/$src.pbm- $args $name.pbm- || rm -f $name.pbm-
+	fi
+done
+missing=0
+for name in $(echo "$SAMPLES" | cut -d' ' -f1); do
+	if [ ! -f $(sample $name) ]; then
+		echo "$name: $DIR/$name.pbm- not found" >&2
+		missing=1
+	fi
+done
+[ $missing = 0 ] || exit 1
+
+bench() {
+	./carps-bench -n $RUNS "$@" || echo "FAILED: $*" >&2
+}
+
+echo "$SAMPLES" | while read name dpi paper; do
+	[ -z "$name" ] && continue
+	pbm=$(sample $name)
+	bench $name pbm-canon $pbm ./rastertocarps-pbm $pbm
+	cp bench.out $name.bench
+	bench $name pbm-g4 $pbm ./rastertocarps-pbm $pbm Compression=G4
+	if ./pbmtoraster $pbm $dpi $paper $name.ras 2>/dev/null; then
+		PPD=$PPD_CANON bench $name raster-canon $pbm ./rastertocarps 1 bench $name 1 "" $name.ras
+		PPD=$PPD_G4 bench $name raster-g4 $pbm ./rastertocarps 1 bench $name 1 "" $name.ras
+		rm -f $name.ras
+	fi
+	bench -d $name.bench $name decode $pbm ./carps-decode $name.bench
+	rm -f $name.bench decoded-p1.pbm
+done
+rm -f bench.out
@@ -0,0 +1,498 @@
+/* CUPS driver for Canon CARPS printers - batch converter */
+/* Copyright (c) 2014 Ondrej Zary */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <cups/ppd.h>
+#include <cups/raster.h>
+#include "libcarps.h"
+#include "carps-util.h"
+
+/*
+ * Converts many CUPS raster or PBM files to CARPS files, like rastertocarps does for one job.
+ * The PPD and options are processed once. Worker threads take whole jobs from one shared queue,
+ * sorted largest first, and convert each with their own carps_stream, so a thread that
+ * finishes early takes the next job instead of waiting for the others. There is no work
+ * stealing within a job: a single large job is converted by one thread. With Canon
+ * compression and StripCache set, each thread keeps its strip cache over all its jobs, so forms
+ * and letterheads are encoded once per thread.
+ */
+
+void usage(void) {
+	fprintf(stderr, "usage: carps-batch [-j threads] [-o dir] [-p file.ppd] [-O options] [-u user] <file>...\n");
+	fprintf(stderr, "  converts CUPS raster or PBM files to <dir>/<name>.carps, names must be unique\n");
+}
+
+/* job settings from PPD and options, read-only while the workers run */
+struct batch_options {
+	enum carps_compression compression;
+	int g4_strip_lines;	/* 0 = whole page */
+	bool max_compression;
+	int strip_budget;
+	bool new_doc_info;
+	u8 image_refinement, toner_save;
+	unsigned int copies;
+	int strip_cache_kb;	/* of each thread, 0 = no strip cache */
+	const char *page_size;	/* when raster page header has none */
+	const char *user;
+	const char *out_dir;
+} opts;
+
+struct batch_job {
+	const char *in;
+	char *out;
+	long long size;
+	/* results */
+	bool failed;
+	int pages;
+	u64 lines, raster_bytes, carps_bytes, ns;
+	unsigned int cache_lookups, cache_hits;
+};
+
+struct batch_job *jobs;
+unsigned int num_jobs, next_job;
+pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct batch_job *job_take(void) {
+	struct batch_job *job = NULL;
+
+	pthread_mutex_lock(&jobs_lock);
+	if (next_job < num_jobs)
+		job = &jobs[next_job++];
+	pthread_mutex_unlock(&jobs_lock);
+
+	return job;
+}
+
+/* larger jobs first, so the last ones to finish are short */
+int job_cmp(const void *a, const void *b) {
+	const struct batch_job *ja = a, *jb = b;
+
+	return (ja->size < jb->size) - (ja->size > jb->size);
+}
+
+struct batch_output {
+	FILE *f;
+	u64 bytes;
+};
+
+void output_block(void *ctx, u8 data_type, u8 block_type, const void *data, u16 data_len) {
+	struct batch_output *out = ctx;
+	struct carps_header header;
+
+	carps_fill_header(&header, data_type, block_type, data_len);
+	fwrite(&header, 1, sizeof(header), out->f);
+	fwrite(data, 1, data_len, out->f);
+	out->bytes += sizeof(header) + data_len;
+}
+
+/* write finished strips of the stream in print data blocks */
+void output_stream(struct batch_output *out, struct carps_stream *s) {
+	struct carps_stream_data d;
+
+	while (carps_stream_pull(s, &d)) {
+		unsigned int blocks = carps_print_blocks_count(d.headers_len, d.len);
+		struct carps_segment *seg = malloc(2 * blocks * sizeof(*seg));
+		u8 *hdr = malloc(carps_print_blocks_size(d.headers_len, d.len));
+		if (!seg || !hdr) {
+			fprintf(stderr, "Memory allocation error\n");
+			exit(2);
+		}
+		unsigned int n = carps_print_blocks(seg, hdr, (u8 *)d.headers, d.headers_len, d.data, d.len);
+		for (unsigned int i = 0; i < n; i++) {
+			fwrite(seg[i].data, 1, seg[i].len, out->f);
+			out->bytes += seg[i].len;
+		}
+		free(hdr);
+		free(seg);
+		free(d.data);
+	}
+}
+
+struct batch_input {
+	FILE *f;		/* PBM */
+	cups_raster_t *ras;
+	u16 line_len_file;
+};
+
+/* read next line padded with zeros to the encoded line length, false if there is none */
+bool input_line(struct batch_input *in, u8 *line, u16 line_len) {
+	/* clear only the padding, the rest is overwritten */
+	memset(line + in->line_len_file, 0, line_len - in->line_len_file);
+	if (in->ras)
+		return cupsRasterReadPixels(in->ras, line, in->line_len_file) != 0;
+	if (feof(in->f))
+		return false;
+	/* partial line at the end is padded with zeros */
+	size_t len = fread(line, 1, in->line_len_file, in->f);
+	memset(line + len, 0, in->line_len_file - len);
+
+	return len > 0;
+}
+
+/* encode one page, returns number of lines or -1 on error */
+int convert_page(struct carps_stream *s, struct batch_input *in, struct batch_output *out, int page, int width, int height, int dpi) {
+	u16 line_len = CARPS_LINE_LEN(width);
+	int lines;
+
+	if (carps_stream_page(s, page, width, height, dpi))
+		return -1;
+	for (lines = 0; lines < height && input_line(in, carps_stream_line(s), line_len); lines++) {
+		if (carps_stream_push_line(s))
+			return -1;
+		output_stream(out, s);
+	}
+	if (carps_stream_page_end(s))
+		return -1;
+	output_stream(out, s);
+	if (s->overflow)
+		fprintf(stderr, "page %d: print data do not fit into %d bytes, output truncated\n", page, BUF_SIZE - 1);
+	s->overflow = false;
+	carps_page_end(output_block, out);
+
+	return lines;
+}
+
+/* PBM header, returns -1 if the file is not PBM */
+int pbm_header(FILE *f, int *width, int *height) {
+	char tmp[100];
+
+	if (!fgets(tmp, sizeof(tmp), f) || strcmp(tmp, "P4\n"))
+		return -1;
+	do
+		if (!fgets(tmp, sizeof(tmp), f))
+			return -1;
+	while (tmp[0] == '#');
+
+	return (sscanf(tmp, "%d %d", width, height) == 2 && *width > 0 && *height > 0) ? 0 : -1;
+}
+
+int convert_job(struct batch_job *job, struct carps_strip_cache *cache) {
+	struct carps_stream s = { 0 };
+	struct batch_input in = { 0 };
+	struct batch_output out = { 0 };
+	struct carps_job cj;
+	cups_page_header2_t page_header;
+	char buf[BUF_SIZE], magic[3];
+	char *title = strdup(job->in);
+	int fd, width, height, lines, ret = -1;
+
+	fd = open(job->in, O_RDONLY);
+	if (fd < 0) {
+		perror(job->in);
+		goto out;
+	}
+	/* PBM or CUPS raster */
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && !memcmp(magic, "P4\n", sizeof(magic))) {
+		in.f = fdopen(fd, "r");
+		if (!in.f || pbm_header(in.f, &width, &height)) {
+			fprintf(stderr, "%s: Invalid PBM file\n", job->in);
+			goto out;
+		}
+		in.line_len_file = DIV_ROUND_UP(width, 8);
+	} else {
+		in.ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+		if (!in.ras) {
+			fprintf(stderr, "%s: Invalid raster file\n", job->in);
+			goto out;
+		}
+	}
+	out.f = fopen(job->out, "w");
+	if (!out.f) {
+		perror(job->out);
+		goto out;
+	}
+	if (!title || carps_stream_init(&s, opts.max_compression, opts.strip_budget) || (cache && carps_stream_cache(&s, cache)))
+		goto err_alloc;
+	if (opts.compression == COMPRESS_G4)
+		carps_stream_g4(&s, opts.g4_strip_lines);
+
+	cj.title = basename(title);
+	cj.user = opts.user;
+	cj.timestamp = time(NULL);
+	cj.new_doc_info = opts.new_doc_info;
+	cj.image_refinement = opts.image_refinement;
+	cj.toner_save = opts.toner_save;
+	carps_job_begin(output_block, &out, &cj);
+
+	if (in.f) {
+		/* 600 dpi, plain paper, A4 as rastertocarps-pbm */
+		carps_fill_print_data_header(buf, opts.copies, 600, WEIGHT_PLAIN, "A4", 0, 0, opts.compression);
+		output_block(&out, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, buf, strlen(buf));
+		lines = convert_page(&s, &in, &out, 1, width, height, 600);
+		if (lines < 0)
+			goto err_alloc;
+		job->pages = 1;
+		job->lines = lines;
+		job->raster_bytes = (u64)lines * in.line_len_file;
+	} else
+		while (cupsRasterReadHeader2(in.ras, &page_header)) {
+			job->pages++;
+			in.line_len_file = page_header.cupsBytesPerLine;
+			if (job->pages == 1) {	/* print data header */
+				const char *page_size_name = page_header.cupsPageSizeName;
+				if (strlen(page_size_name) == 0)
+					page_size_name = opts.page_size;
+				carps_fill_print_data_header(buf, opts.copies, page_header.HWResolution[0], page_header.cupsMediaType, page_size_name, page_header.PageSize[0], page_header.PageSize[1], opts.compression);
+				output_block(&out, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, buf, strlen(buf));
+			}
+			lines = convert_page(&s, &in, &out, job->pages, page_header.cupsWidth, page_header.cupsHeight, page_header.HWResolution[0]);
+			if (lines < 0)
+				goto err_alloc;
+			job->lines += lines;
+			job->raster_bytes += (u64)lines * in.line_len_file;
+		}
+	carps_job_end(output_block, &out);
+	if (fflush(out.f) || ferror(out.f)) {
+		perror(job->out);
+		goto out;
+	}
+	job->carps_bytes = out.bytes;
+	ret = 0;
+	goto out;
+err_alloc:
+	fprintf(stderr, "%s: Memory allocation error\n", job->in);
+out:
+	carps_stream_free(&s);
+	if (out.f) {
+		fclose(out.f);
+		if (ret)
+			unlink(job->out);
+	}
+	if (in.ras)
+		cupsRasterClose(in.ras);
+	if (in.f)
+		fclose(in.f);
+	else if (fd >= 0)
+		close(fd);
+	free(title);
+
+	return ret;
+}
+
+void *batch_worker(__attribute__((unused)) void *arg) {
+	struct carps_strip_cache cache = { 0 };
+	bool use_cache = opts.compression == COMPRESS_CANON && opts.strip_cache_kb && !opts.strip_budget;
+	struct batch_job *job;
+
+	if (use_cache && carps_strip_cache_init(&cache, (size_t)opts.strip_cache_kb * 1024)) {
+		fprintf(stderr, "Memory allocation error, strip cache not used\n");
+		use_cache = false;
+	}
+	while ((job = job_take())) {
+		struct carps_strip_cache_stats stats = cache.stats;
+		u64 start = time_ns();
+		job->failed = convert_job(job, use_cache ? &cache : NULL) != 0;
+		job->ns = time_ns() - start;
+		job->cache_lookups = cache.stats.lookups - stats.lookups;
+		job->cache_hits = cache.stats.hits - stats.hits;
+	}
+	carps_strip_cache_free(&cache);
+
+	return NULL;
+}
+
+/* <dir>/<name without extension>.carps */
+char *output_name(const char *in) {
+	char *tmp = strdup(in), *name, *dot, *out;
+
+	if (!tmp)
+		return NULL;
+	name = basename(tmp);
+	dot = strrchr(name, '.');
+	if (dot && dot != name)
+		*dot = '\0';
+	if (asprintf(&out, "%s/%s.carps", opts.out_dir, name) < 0)
+		out = NULL;
+	free(tmp);
+
+	return out;
+}
+
+/* outputs in name order */
+int out_cmp(const void *a, const void *b) {
+	const struct batch_job *const *ja = a, *const *jb = b;
+
+	return strcmp((*ja)->out, (*jb)->out);
+}
+
+/* outputs must not overwrite each other (a.ras and a.pbm, or x/a.ras and y/a.ras) or an input */
+bool check_outputs(void) {
+	struct batch_job **by_out = malloc(num_jobs * sizeof(*by_out));
+	bool ok = true;
+
+	if (!by_out) {
+		fprintf(stderr, "Memory allocation error\n");
+		exit(2);
+	}
+	for (unsigned int i = 0; i < num_jobs; i++)
+		by_out[i] = &jobs[i];
+	qsort(by_out, num_jobs, sizeof(*by_out), out_cmp);
+	for (unsigned int i = 1; i < num_jobs; i++)
+		if (!strcmp(by_out[i - 1]->out, by_out[i]->out)) {
+			fprintf(stderr, "%s and %s would both be converted to %s\n", by_out[i - 1]->in, by_out[i]->in, by_out[i]->out);
+			ok = false;
+		}
+	for (unsigned int i = 0; i < num_jobs; i++) {
+		struct stat in, out;
+		if (!stat(jobs[i].in, &in) && !stat(jobs[i].out, &out) && in.st_dev == out.st_dev && in.st_ino == out.st_ino) {
+			fprintf(stderr, "%s would be overwritten by its output\n", jobs[i].in);
+			ok = false;
+		}
+	}
+	free(by_out);
+
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN), opt, failed = 0, pages = 0;
+	const char *ppd_name = NULL, *option_str = NULL;
+	struct job_options jo = { 0 };
+	pthread_t *threads;
+	struct rusage ru;
+	u64 start, ns, lines = 0, raster_bytes = 0, carps_bytes = 0;
+	unsigned int cache_lookups = 0, cache_hits = 0;
+
+	opts.out_dir = ".";
+	opts.user = getenv("USER") ? getenv("USER") : "root";
+	while ((opt = getopt(argc, argv, "j:o:p:O:u:")) != -1) {
+		switch (opt) {
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+		case 'o':
+			opts.out_dir = optarg;
+			break;
+		case 'p':
+			ppd_name = optarg;
+			break;
+		case 'O':
+			option_str = optarg;
+			break;
+		case 'u':
+			opts.user = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind >= argc || num_threads < 1) {
+		usage();
+		return 1;
+	}
+
+	/* PPD and options are processed once for all jobs, options are tuning too */
+	if (option_str)
+		jo.num_options = cupsParseOptions(option_str, 0, &jo.options);
+	jo.tuning_options = true;
+	tuning_parse(&jo);
+	if (ppd_name) {
+		jo.ppd = ppdOpenFile(ppd_name);
+		if (!jo.ppd) {
+			fprintf(stderr, "Unable to open PPD file %s\n", ppd_name);
+			return 2;
+		}
+		ppdMarkDefaults(jo.ppd);
+		cupsMarkOptions(jo.ppd, jo.num_options, jo.options);
+	}
+	opts.compression = strcmp(ppd_get(&jo, "Compression"), "G4") ? COMPRESS_CANON : COMPRESS_G4;
+	opts.g4_strip_lines = atoi(ppd_get(&jo, "G4StripHeight"));	/* "Page" = 0 */
+	opts.max_compression = !strcmp(ppd_get(&jo, "MaxCompression"), "ON");
+	opts.strip_budget = atoi(ppd_get(&jo, "StripBudget"));	/* "Fixed" = 0 */
+	opts.new_doc_info = !strcmp(ppd_get(&jo, "NewDocInfo"), "1");
+	opts.image_refinement = strcmp(ppd_get(&jo, "ImageRefinement"), "OFF") ? CARPS_PARAM_ENABLED : CARPS_PARAM_DISABLED;
+	char *value = ppd_get(&jo, "TonerSave");
+	if (!strcmp(value, "DEFAULT"))
+		opts.toner_save = 0;
+	else
+		opts.toner_save = strcmp(value, "ON") ? CARPS_PARAM_DISABLED : CARPS_PARAM_ENABLED;
+	opts.strip_cache_kb = atoi(tuning_get(&jo, "StripCache"));	/* KB, "Off" = 0 */
+	opts.page_size = ppd_get(&jo, "PageSize");
+	const char *copies = cupsGetOption("copies", jo.num_options, jo.options);
+	opts.copies = (copies && atoi(copies) > 0) ? atoi(copies) : 1;
+
+	num_jobs = argc - optind;
+	jobs = calloc(num_jobs, sizeof(struct batch_job));
+	if (!jobs) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 2;
+	}
+	for (unsigned int i = 0; i < num_jobs; i++) {
+		struct stat st;
+		jobs[i].in = argv[optind + i];
+		jobs[i].size = stat(jobs[i].in, &st) ? 0 : st.st_size;
+		jobs[i].out = output_name(jobs[i].in);
+		if (!jobs[i].out) {
+			fprintf(stderr, "Memory allocation error\n");
+			return 2;
+		}
+	}
+	if (!check_outputs())
+		return 1;
+	qsort(jobs, num_jobs, sizeof(struct batch_job), job_cmp);
+
+	if ((unsigned int)num_threads > num_jobs)
+		num_threads = num_jobs;
+	threads = calloc(num_threads, sizeof(pthread_t));
+	if (!threads) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 2;
+	}
+	start = time_ns();
+	for (int i = 0; i < num_threads; i++)
+		if (pthread_create(&threads[i], NULL, batch_worker, NULL)) {
+			fprintf(stderr, "Unable to start worker threads\n");
+			return 2;
+		}
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	ns = time_ns() - start;
+	getrusage(RUSAGE_SELF, &ru);
+
+	for (unsigned int i = 0; i < num_jobs; i++) {
+		struct batch_job *job = &jobs[i];
+		if (job->failed) {
+			printf("%s: FAILED\n", job->in);
+			failed++;
+			continue;
+		}
+		printf("%s -> %s: %d pages, %llu lines, %llu bytes, %llu ms, %u of %u strips from cache\n", job->in, job->out, job->pages,
+		       (unsigned long long)job->lines, (unsigned long long)job->carps_bytes, (unsigned long long)job->ns / 1000000,
+		       job->cache_hits, job->cache_lookups);
+		pages += job->pages;
+		lines += job->lines;
+		raster_bytes += job->raster_bytes;
+		carps_bytes += job->carps_bytes;
+		cache_lookups += job->cache_lookups;
+		cache_hits += job->cache_hits;
+	}
+	double s = ns / 1e9, cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+	printf("%u jobs (%d failed), %d pages, %llu lines with %d threads in %.3f s (%.3f s CPU): "
+	       "%.1f pages/s, %.0f lines/s, %.2f MB/s raster, %llu bytes CARPS (ratio %.2f)\n",
+	       num_jobs, failed, pages, (unsigned long long)lines, num_threads, s, cpu,
+	       pages / s, lines / s, raster_bytes / 1e6 / s, (unsigned long long)carps_bytes,
+	       carps_bytes ? (double)raster_bytes / carps_bytes : 0);
+	if (cache_lookups)
+		printf("strip cache: %u of %u strips (%.1f%%) found\n", cache_hits, cache_lookups, 100.0 * cache_hits / cache_lookups);
+
+	for (unsigned int i = 0; i < num_jobs; i++)
+		free(jobs[i].out);
+	free(jobs);
+	free(threads);
+	if (jo.ppd)
+		ppdClose(jo.ppd);
+	job_options_free(&jo);
+
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,144 @@
+/* CUPS driver for Canon CARPS printers - benchmark runner */
+/* Copyright (c) 2014 Ondrej Zary */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Runs a command several times and prints one JSON line with the best wall time and the peak
+ * RSS. Raster size comes from the PBM file the command encodes (or the decoder produces), CARPS
+ * size is the command output (encoder) or input (decoder).
+ */
+
+void usage(void) {
+	fprintf(stderr, "usage: carps-bench [-n runs] [-d carps-file] <case> <mode> <file.pbm> <command> [args...]\n");
+	fprintf(stderr, "  command output goes to bench.out, -d: command decodes carps-file\n");
+}
+
+double time_s(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long long file_size(const char *name) {
+	struct stat st;
+
+	return stat(name, &st) ? -1 : st.st_size;
+}
+
+int pbm_size(const char *name, int *width, int *height) {
+	char tmp[100];
+	FILE *f = fopen(name, "r");
+
+	if (!f)
+		return -1;
+	if (!fgets(tmp, sizeof(tmp), f) || strcmp(tmp, "P4\n")) {
+		fclose(f);
+		return -1;
+	}
+	do
+		if (!fgets(tmp, sizeof(tmp), f)) {
+			fclose(f);
+			return -1;
+		}
+	while (tmp[0] == '#');
+	fclose(f);
+
+	return (sscanf(tmp, "%d %d", width, height) == 2) ? 0 : -1;
+}
+
+/* run command with output to bench.out, returns exit status or -1 */
+int run(char **argv, double *wall, double *cpu, long *max_rss) {
+	struct rusage ru;
+	int status;
+	double start = time_s();
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return -1;
+	if (!pid) {
+		int fd = open("bench.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		int null = open("/dev/null", O_WRONLY);
+		if (fd < 0 || null < 0)
+			_exit(127);
+		dup2(fd, 1);
+		dup2(null, 2);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	if (wait4(pid, &status, 0, &ru) < 0)
+		return -1;
+	*wall = time_s() - start;
+	*cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+	*max_rss = ru.ru_maxrss;
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int main(int argc, char *argv[]) {
+	int runs = 3, opt, width, height;
+	char *decode = NULL;
+	double best = 0, best_cpu = 0;
+	long peak_rss = 0;
+
+	while ((opt = getopt(argc, argv, "+n:d:")) != -1) {
+		switch (opt) {
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 'd':
+			decode = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (argc - optind < 4 || runs < 1) {
+		usage();
+		return 1;
+	}
+	char *name = argv[optind], *mode = argv[optind + 1], *pbm = argv[optind + 2];
+	if (pbm_size(pbm, &width, &height)) {
+		fprintf(stderr, "Invalid PBM file %s\n", pbm);
+		return 2;
+	}
+
+	for (int i = 0; i < runs; i++) {
+		double wall, cpu;
+		long rss;
+		int ret = run(argv + optind + 3, &wall, &cpu, &rss);
+		if (ret) {
+			fprintf(stderr, "%s %s: command failed (%d)\n", name, mode, ret);
+			return 2;
+		}
+		if (!i || wall < best) {
+			best = wall;
+			best_cpu = cpu;
+		}
+		if (rss > peak_rss)
+			peak_rss = rss;
+	}
+
+	long long raster_bytes = (long long)(width + 7) / 8 * height;
+	long long carps_bytes = file_size(decode ? decode : "bench.out");
+	printf("{\"case\": \"%s\", \"mode\": \"%s\", \"width\": %d, \"lines\": %d, \"raster_bytes\": %lld, "
+	       "\"carps_bytes\": %lld, \"ratio\": %.2f, \"runs\": %d, \"seconds\": %.4f, \"cpu_seconds\": %.4f, "
+	       "\"raster_mb_s\": %.2f, \"lines_s\": %.0f, \"peak_rss_kb\": %ld}\n",
+	       name, mode, width, height, raster_bytes,
+	       carps_bytes, carps_bytes > 0 ? (double)raster_bytes / carps_bytes : 0, runs, best, best_cpu,
+	       raster_bytes / 1e6 / best, height / best, peak_rss);
+
+	return 0;
+}
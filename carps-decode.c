@@ -1,11 +1,18 @@
 /* CUPS driver for Canon CARPS printers - decoder */
 /* Copyright (c) 2014 Ondrej Zary */
+#define _POSIX_C_SOURCE 200809L
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "carps.h"
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libcarps.h"
+
+bool trace;	/* print blocks, bits and tokens */
+#define TRACE(fmt, args ...)	do { if (trace) printf(fmt, ##args); } while (0)
 
 void print_header(struct carps_header *header) {
 	printf("magic1     = 0x%02x %s\n", header->magic1, (header->magic1 == 0xCD) ? "" : "!!!!!!!!");
@@ -46,16 +53,80 @@ void print_time(struct carps_time *time) {
 		((time->sec_msec & 0x3) << 8) | time->msec);
 }
 
-long block_pos;
-enum carps_compression compression = COMPRESS_CANON;
+/*
+ * Input is mapped if it is a regular file and blocks are parsed in place. A pipe is read into
+ * buf, which holds the current block and continuation blocks of a strip (data_len is 16-bit).
+ */
+struct input {
+	FILE *f;
+	u8 *map;	/* whole input file, NULL if not mapped */
+	size_t size;
+	unsigned int fill;
+	long pos, block_pos;	/* input is not seeked, so it can be a pipe */
+	int blocks;
+	u8 buf[BUF_SIZE + 2 * MAX_BLOCK_LEN];
+};
+
+void input_open(struct input *in, FILE *f) {
+	struct stat st;
+
+	in->f = f;
+	in->map = NULL;
+	in->pos = in->block_pos = 0;
+	in->blocks = 0;
+	if (fstat(fileno(f), &st) || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return;
+	in->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (in->map == MAP_FAILED)
+		in->map = NULL;
+	else
+		in->size = st.st_size;
+}
 
-#define NO_HEADER	(1 << 0)
-int get_block(u8 *buf, FILE *f, int flags) {
-	u8 *data;
-	static int i = 0;
+void input_close(struct input *in) {
+	if (in->map)
+		munmap(in->map, in->size);
+	fclose(in->f);
+}
+
+/* next n bytes of input, NULL if not available */
+u8 *input_read(struct input *in, unsigned int n) {
+	u8 *p;
 
-	if (fread(buf, 1, sizeof(struct carps_header), f) != sizeof(struct carps_header)) {
-		if (feof(f)) {
+	if (in->map) {
+		if (in->size - in->pos < n)
+			return NULL;
+		p = in->map + in->pos;
+	} else {
+		if (in->fill + n > sizeof(in->buf)) {
+			printf("Strip too long\n");
+			return NULL;
+		}
+		p = in->buf + in->fill;
+		if (fread(p, 1, n, in->f) != n)
+			return NULL;
+		in->fill += n;
+	}
+	in->pos += n;
+
+	return p;
+}
+
+void read_error(struct input *in) {
+	if (in->map || feof(in->f))
+		printf("Error reading file: truncated block\n");
+	else
+		perror("Error reading file");
+}
+
+/* read a block, continuation blocks (NO_HEADER) of print data do not overwrite the previous ones */
+#define NO_HEADER	(1 << 0)
+int get_block(struct input *in, struct carps_header **header, u8 **data, int flags) {
+	if (!(flags & NO_HEADER))
+		in->fill = 0;
+	struct carps_header *hdr = (void *)input_read(in, sizeof(struct carps_header));
+	if (!hdr) {
+		if (in->map || feof(in->f)) {
 			printf("EOF\n");
 			return -1;
 		}
@@ -64,183 +135,118 @@ int get_block(u8 *buf, FILE *f, int flags) {
 	}
 
 	if (0) {
-		printf("========== BLOCK %d ==========\n", i++);
-		print_header((struct carps_header *)buf);
-	} else {
-		struct carps_header *header = (void *)buf;
-		printf("BLOCK %d (len=%d): ", i++, be16_to_cpu(header->data_len));
-	}
+		printf("========== BLOCK %d ==========\n", in->blocks++);
+		print_header(hdr);
+	} else
+		TRACE("BLOCK %d (len=%d): ", in->blocks++, be16_to_cpu(hdr->data_len));
 
-	struct carps_header *header = (void *)buf;
-	u16 len = be16_to_cpu(header->data_len);
+	u16 len = be16_to_cpu(hdr->data_len);
+	if (header)
+		*header = hdr;
 
 	if (flags & NO_HEADER) {
-		data = buf;
-		fread(data, 1, 1, f);	/* discard the first 0x01 byte */
-		if (data[0] != 0x01)
-			printf("Invalid data in print block - first byte 0x%02x, expected 0x01\n", data[0]);
+		u8 *one = input_read(in, 1);	/* discard the first 0x01 byte */
+		if (!one) {
+			read_error(in);
+			return -3;
+		}
+		if (*one != 0x01)
+			printf("Invalid data in print block - first byte 0x%02x, expected 0x01\n", *one);
 		len -= 1;
-	} else
-		data = buf + sizeof(struct carps_header);
+	}
 
-	block_pos = ftell(f);
+	in->block_pos = in->pos;
 
-	if (fread(data, 1, len, f) != len) {
-		perror("Error reading file");
+	*data = input_read(in, len);
+	if (!*data) {
+		read_error(in);
 		return -3;
 	}
 
 	return len;
 }
 
-/* get n bits of data */
-u8 get_bits(u8 **data, u16 *len, u8 *bitpos, u8 n) {
-	u8 bits = 0;
-	u8 byte;
-
-	for (int i = 0; i < n; i++) {
-		if (*len == 0) {
-			printf("%s DATA UNDERFLOW\n", bin_n(bits, i));
-			return 0;
-		}
-		byte = *data[0] ^ PRINT_DATA_XOR;
-		bits <<= 1;
-		bits |= ((byte << *bitpos) & 0x80) >> 7;
-		(*bitpos)++;
-		if (*bitpos > 7) {
-			(*data)++;
-			(*len)--;
-			*bitpos = 0;
-		}
-	}
-	printf("%s ", bin_n(bits, n));
-
-	return bits;
-}
-
-void go_backward(int num_bits, u8 **data, u16 *len, u8 *bitpos) {
-	if (*bitpos >= num_bits)
-		*bitpos -= num_bits;
-	else {
-		(*data)--;
-		(*len)++;
-		*bitpos = 8 - (num_bits - *bitpos);
-	}
+bool output_header;
+FILE *output;	/* --stdout: all pages go here instead of decoded-p*.* files */
+
+/* print data decoding state */
+struct decode {
+	struct carps_decoder dec;
+	enum carps_compression compression;
+	bool start_of_strip;
+	int width, page;
+	long height_pos;	/* of height in PBM header */
+	FILE *fout;		/* current output file, NULL if none */
+	/* G4 strip data are collected and decoded at the next strip header or end of page */
+	struct carps_g4_decoder g4;
+	u8 *g4_data;
+	u32 g4_len, g4_size;
+	int g4_height;		/* lines of current strip */
+	int g4_lines;		/* lines of page */
+};
+
+void close_output(FILE *fout) {
+	if (fout == output)
+		fflush(fout);
+	else if (fout)
+		fclose(fout);
 }
 
-int count_ones(int max, u8 **data, u16 *len, u8 *bitpos) {
-	int i = 0;
+/* write out lines decoded so far */
+void write_lines(struct decode *d) {
+	const u8 *line;
 
-	while (i < max && get_bits(data, len, bitpos, 1))
-		i++;
-
-	return i;
+	while ((line = carps_decoder_pull_line(&d->dec)))
+		fwrite(line, 1, d->dec.line_len, d->fout);
 }
 
-/* decode a number beginning with 00, 01, 10, 110, 1110, 11110, 111110 */
-int decode_number(u8 **data, u16 *len, u8 *bitpos) {
-	int num_bits;
-	printf("decode_number ");
-
-	num_bits = count_ones(6, data, len, bitpos) + 1;
-	if (num_bits == 7)
-		return 0;
-
-	if (num_bits == 1) {
-		if (get_bits(data, len, bitpos, 1))
-			num_bits = 1;
-		else
-			return 1;
+/* decode collected G4 strip and write out its lines */
+void g4_strip_end(struct decode *d) {
+	u16 line_len = CARPS_LINE_LEN(d->width);
+
+	if (!d->g4_height)
+		return;
+	u8 *lines = malloc((size_t)d->g4_height * line_len);
+	int num = lines ? carps_g4_decode(&d->g4, d->g4_data, d->g4_len, d->width, d->g4_height, lines) : -1;
+	if (num < 0) {
+		printf("Memory allocation error\n");
+		exit(2);
 	}
-
-	return (1 << num_bits) + (~get_bits(data, len, bitpos, num_bits) & MASK(num_bits));
-}
-
-u8 *last_lines[8], *cur_line;
-int out_bytes;
-u16 line_num, line_pos, line_len;
-bool output_header;
-long height_pos;
-
-void next_line(void) {
-	memcpy(last_lines[7], last_lines[6], line_len);
-	memcpy(last_lines[6], last_lines[5], line_len);
-	memcpy(last_lines[5], last_lines[4], line_len);
-	memcpy(last_lines[4], last_lines[3], line_len);
-	memcpy(last_lines[3], last_lines[2], line_len);
-	memcpy(last_lines[2], last_lines[1], line_len);
-	memcpy(last_lines[1], last_lines[0], line_len);
-	memcpy(last_lines[0], cur_line, line_len);
-	line_pos = 0;
-	line_num++;
+	if (num < d->g4_height)
+		printf("Invalid G4 data: only %d of %d lines decoded !!!!!!!!\n", num, d->g4_height);
+	if (d->fout)
+		fwrite(lines, line_len, num, d->fout);
+	free(lines);
+	d->g4_lines += num;
+	d->g4_len = 0;
+	d->g4_height = 0;
 }
 
-void output_byte(u8 byte, u8 *buf, FILE *fout) {
-	printf("DICTIONARY=");
-	for (int j = 0; j < DICT_SIZE; j++)
-		printf("%02X ", buf[j]);
-	printf("\n");
-
-	for (int i = 0; i < DICT_SIZE; i++)
-		if (buf[i] == byte) {
-			memmove(buf + i, buf + i + 1, DICT_SIZE - i);
-			break;
-		}
-	memmove(buf + 1, buf, DICT_SIZE - 1);
-	buf[0] = byte;
-	fwrite(&byte, 1, 1, fout);
-	cur_line[line_pos] = byte;
-	printf("BYTE=%x\n", byte);
-	out_bytes++;
-	line_pos++;
-	if (line_pos >= line_len)
-		next_line();
-}
+/* write out incomplete line (or G4 strip) at end of page, returns number of lines */
+int end_page(struct decode *d) {
+	const u8 *partial;
+	u16 len;
+	int lines = carps_decoder_page_end(&d->dec, &partial, &len);
 
-void output_bytes_last(int count, int offset, FILE *fout) {
-	for (int i = 0; i < count; i++) {
-		u8 byte;
-		if (line_pos - offset < 0)
-			byte = last_lines[0][line_len - offset];
-		else
-			byte = cur_line[line_pos - offset];
-		printf("%02x ", byte);
-		fwrite(&byte, 1, 1, fout);
-		cur_line[line_pos] = byte;
-		line_pos++;
+	if (d->compression == COMPRESS_G4) {
+		g4_strip_end(d);
+		lines = d->g4_lines;
+		d->g4_lines = 0;
+		return lines;
 	}
-	printf("\n");
-	out_bytes += count;
-	if (line_pos >= line_len)
-		next_line();
-}
 
-void output_previous(int line, int count, FILE *fout) {
-	printf("previous (line=%d): ", line);
-	for (int i = 0; i < count; i++)
-		printf("%02x ", last_lines[line][line_pos + i]);
-	printf("\n");
-	fwrite(last_lines[line] + line_pos, 1, count, fout);
-	memcpy(cur_line + line_pos, last_lines[line] + line_pos, count);
+	if (d->fout && len)
+		fwrite(partial, 1, len, d->fout);
 
-	out_bytes += count;
-	line_pos += count;
-	if (line_pos >= line_len)
-		next_line();
+	return lines;
 }
 
 #define TMP_BUFLEN 100
 
-int decode_print_data(u8 *data, u16 len, FILE *f, FILE **fout) {
+int decode_print_data(struct decode *d, u8 *data, u16 len, struct input *in) {
 	bool in_escape = false;
-	static bool start_of_strip = true;
 	int i;
-	int count;
-	int base = 0;
-	u8 dictionary[DICT_SIZE];
-	bool twobyte_flag = false, prev8_flag = false;
 	char tmp[TMP_BUFLEN];
-	static int width, page = 1;
 	int height;
 	char filename[30];
 
@@ -251,21 +257,32 @@ int decode_print_data(u8 *data, u16 len, FILE *f, FILE **fout) {
 
 	if (len == 2 && data[1] == 0x0c) {
 		printf("end of page\n");
-		start_of_strip = true;
+		d->start_of_strip = true;
+		int lines = end_page(d);
 		/* now we know line count so we can fill it in */
-		if (compression == COMPRESS_CANON && output_header) {
-			fseek(*fout, height_pos, SEEK_SET);
-			fprintf(*fout, "%4d", line_num);
+		if (output_header && d->fout) {
+			fseek(d->fout, d->height_pos, SEEK_SET);
+			fprintf(d->fout, "%4d", lines);
+			fseek(d->fout, 0, SEEK_END);
 		}
-		fclose(*fout);
-		*fout = NULL;
-		page++;
-		line_num = 0;
+		close_output(d->fout);
+		d->fout = NULL;
+		d->page++;
 		return 0;
 	}
 
+	/* strip data end marker (0x80) does not fit into the previous block */
+	if (d->compression == COMPRESS_CANON && d->start_of_strip && len == 2 && data[1] == 0x80) {
+		TRACE("strip data end\n");
+		return 0;
+	}
+
+	/* G4 data has no end marker, next strip of a page starts in a new block with its header */
+	if (d->compression == COMPRESS_G4 && !d->start_of_strip && !strncmp((char *)data + 1, "\x1b[;", 3))
+		d->start_of_strip = true;
+
 	/* read and display escape sequences at start of strip */
-	for (i = 1; start_of_strip && i < len; i++) {
+	for (i = 1; d->start_of_strip && i < len; i++) {
 		if (data[i] == ESC) {	/* escape sequence begin */
 			if (in_escape)
 				printf("\n");
@@ -278,6 +295,11 @@ int decode_print_data(u8 *data, u16 len, FILE *f, FILE **fout) {
 			printf("%c", data[i]);
 		else
 			break;
+		/* strip header ends with 'P', data can follow in the same block */
+		if (data[i] == 'P' && data[i - 1] == '.') {
+			i++;
+			break;
+		}
 	}
 
 	if (!strncmp((char *)data + 1, "\x1b[;", 3)) {
@@ -288,57 +310,71 @@ int decode_print_data(u8 *data, u16 len, FILE *f, FILE **fout) {
 		strncpy(tmp, (char *)data + 3, i);
 		tmp[i] = '\0';
 		int comp;
-		sscanf(tmp, ";%d;%d;%d.", &width, &height, &comp);
-		printf(" width=%d, height=%d, compression=%d\n", width, height, comp);
+		g4_strip_end(d);
+		sscanf(tmp, ";%d;%d;%d.", &d->width, &height, &comp);
+		printf(" width=%d, height=%d, compression=%d\n", d->width, height, comp);
 		if (comp != COMPRESS_CANON && comp != COMPRESS_G4)
 			printf("UNKNOWN COMPRESSION TYPE!!!!!!!!\n");
-		compression = comp;
-		if (compression == COMPRESS_CANON) {
-			line_len = ROUND_UP_MULTIPLE(DIV_ROUND_UP(width, 8), 4);
+		d->compression = comp;
+		if (d->compression == COMPRESS_G4)
+			d->g4_height = height;
+		if (d->compression == COMPRESS_CANON) {
+			u16 line_len = CARPS_LINE_LEN(d->width);
 			printf("line_len=%d\n", line_len);
-			cur_line = realloc(cur_line, line_len);
-			for (int i = 0; i < 8; i++)
-				last_lines[i] = realloc(last_lines[i], line_len);
+			if (carps_decoder_line_len(&d->dec, line_len)) {
+				printf("Memory allocation error\n");
+				return 2;
+			}
 		}
 	}
 
 	data += i;
 	len -= i;
 
-	if (!*fout && len > 0) {
-		snprintf(filename, sizeof(filename), "decoded-p%d.%s", page, (compression == COMPRESS_CANON) ? "pbm" : "g4");
-		printf("\ncreating output file %s", filename);
-		if (compression == COMPRESS_G4)
-			printf(" - use 'fax2tiff -4 -8 -X %d %s -o decoded-p%d.tiff' to convert", width, filename, page);
-		printf("\n");
-		*fout = fopen(filename, "w");
-		if (!*fout) {
-			perror("Unable to open output file");
-			return 2;
+	if (!d->fout && len > 0) {
+		if (output) {
+			printf("\nwriting page %d to stdout\n", d->page);
+			d->fout = output;
+		} else {
+			snprintf(filename, sizeof(filename), "decoded-p%d.pbm", d->page);
+			printf("\ncreating output file %s\n", filename);
+			d->fout = fopen(filename, "w");
+			if (!d->fout) {
+				perror("Unable to open output file");
+				return 2;
+			}
 		}
-		if (compression == COMPRESS_CANON && output_header) {
-			fprintf(*fout, "P4\n%d ", line_len * 8);
-			height_pos = ftell(*fout);
-			fprintf(*fout, "%4d\n", 0); /* we don't know height yet */
+		if (output_header) {
+			fprintf(d->fout, "P4\n%d ", CARPS_LINE_LEN(d->width) * 8);
+			d->height_pos = ftell(d->fout);
+			fprintf(d->fout, "%4d\n", 0); /* we don't know height yet */
 		}
 	}
 
 	if (len > 0)
-		start_of_strip = false;
-
-	if (compression == COMPRESS_G4 && len > 0) {
-		printf("%d bytes of G4 data\n", len);
-		fwrite(data, 1, len, *fout);
+		d->start_of_strip = false;
+
+	if (d->compression == COMPRESS_G4 && len > 0) {
+		TRACE("%d bytes of G4 data\n", len);
+		if (d->g4_len + len > d->g4_size) {
+			d->g4_size = d->g4_size ? 2 * d->g4_size : BUF_SIZE;
+			d->g4_data = realloc(d->g4_data, d->g4_size);
+			if (!d->g4_data) {
+				printf("Memory allocation error\n");
+				exit(2);
+			}
+		}
+		memcpy(d->g4_data + d->g4_len, data, len);
+		d->g4_len += len;
 		return 0;
 	}
 	if (len < sizeof(struct carps_print_header)) {
-		printf("\n");
+		TRACE("\n");
 		return -1;
 	}
 
-	memset(dictionary, 0xaa, DICT_SIZE);
-
 	struct carps_print_header *header = (void *)data;
+	u32 total = len, data_len = len;
 	if (header->one != 0x01 || header->two != 0x02 || header->four != 0x04 || header->eight != 0x08 || header->zero1 != 0x0000 || header->magic != 0x50
 			|| header->zero2 != 0x00) {
 		printf("!!!!!!!");
@@ -352,134 +388,89 @@ int decode_print_data(u8 *data, u16 len, FILE *f, FILE **fout) {
 		printf("data_len=0x%04x\n", le16_to_cpu(header->data_len));
 		printf("zero3=0x%04x\n", header->zero3);*/
 	} else {
-		printf("Data length: %d ", le16_to_cpu(header->data_len));
+		TRACE("Data length: %d ", le16_to_cpu(header->data_len));
 		data += sizeof(struct carps_print_header);
 		len  -= sizeof(struct carps_print_header);
-		u8 *data2 = data + len;
-		while (len < le16_to_cpu(header->data_len)) {
-			int ret;
-			printf("we have only %d bytes: reading next block\n", len);
-			ret = get_block(data2, f, NO_HEADER);
-			if (ret < 0)
-				return ret;
-			else {
-				len += ret;
-				data2 += ret;
-			}
-		}
-		printf("ok, we have %d bytes\n", len);
+		total = len;
+		data_len = le16_to_cpu(header->data_len);
 	}
-	printf("len=%d", len);
-	printf("\n");
-
-	u8 bitpos = 0;
-
-	while (len) {
-		printf("out_pos: 0x%x, line_num=%d, line_pos=%d (%d), len=%d, in_pos=0x%x ", out_bytes, line_num, line_pos, line_pos * 8, len, block_pos + data - start);
-
-		u8 bits = get_bits(&data, &len, &bitpos, 1);
-		if (bits) { /* 1 */
-			bits = get_bits(&data, &len, &bitpos, 1);
-			if (bits) { /* 11 */
-				bits = get_bits(&data, &len, &bitpos, 2);
-				switch (bits) {
-				case 0b11: /* 1111 */
-					bits = get_bits(&data, &len, &bitpos, 1);
-					if (bits) { /* 11111 */
-						bits = get_bits(&data, &len, &bitpos, 1);
-						if (bits) { /* 111111 */
-							bits = get_bits(&data, &len, &bitpos, 2);
-							switch (bits) {
-							case 0b01:
-								printf("zero byte\n");
-								output_byte(0, dictionary, *fout);
-								break;
-							case 0b00:
-								count = decode_number(&data, &len, &bitpos);
-								printf("PREFIX %d\n", count * 128);
-								base = count * 128;
-								break;
-							case 0b10:
-								printf("strip end marker\n");
-								start_of_strip = true;
-								return 0;
-							default:
-								printf("!!!!!!!! 0b%s\n", bin_n(bits, 2));
-							}
-						} else { /* 111110 */
-							go_backward(4, &data, &len, &bitpos);
-							twobyte_flag = !twobyte_flag;
-							printf("twobyte_flag := %d\n", twobyte_flag);
-						}
-					} else { /* 11110 */
-						count = decode_number(&data, &len, &bitpos);
-						printf("%d bytes from this line [@-80]\n", count);
-						output_bytes_last(count, 80, *fout);
-					}
-					break;
-				case 0b01: /* 1101 */
-					bits = get_bits(&data, &len, &bitpos, 8);
-					printf("byte immediate 0b%s\n", bin_n(bits, 8));
-					output_byte(bits, dictionary, *fout);
-					break;
-				case 0b00: /* 1100 */
-					go_backward(1, &data, &len, &bitpos);
-					prev8_flag = !prev8_flag;
-					printf("prev8_flag := %d\n", prev8_flag);
-					break;
-				case 0b10: /* 1110 */
-					count = decode_number(&data, &len, &bitpos);
-					printf("%d last bytes (+%d)\n", count + base, base);
-					output_bytes_last(count + base, twobyte_flag ? 2 : 1, *fout);
-					base = 0;
-					break;
-				}
-			} else { /* 10 */
-				/* DICTIONARY */
-				bits = get_bits(&data, &len, &bitpos, 4);
-				printf("[%d] byte from dictionary\n", (~bits & 0b1111));
-				output_byte(dictionary[(~bits & 0b1111)], dictionary, *fout);
-			}
-		} else { /* 0 */
-			count = decode_number(&data, &len, &bitpos);
-			printf("%d bytes from previous line (+%d)\n", count + base, base);
-			output_previous(prev8_flag ? 7 : 3, count + base, *fout);
-			base = 0;
-		}
+	TRACE("len=%d", total);
+	TRACE("\n");
+
+	/* strip data continue in following blocks, they are decoded in place */
+	carps_decoder_strip(&d->dec);
+	carps_decoder_push(&d->dec, data, len, in->block_pos + data - start, total >= data_len);
+	for (;;) {
+		int ret;
+		u8 *data2;
+		write_lines(d);
+		if (total >= data_len)
+			break;
+		TRACE("we have only %d bytes: reading next block\n", total);
+		ret = get_block(in, NULL, &data2, NO_HEADER);
+		if (ret < 0)
+			return ret;
+		total += ret;
+		carps_decoder_push(&d->dec, data2, ret, in->block_pos, total >= data_len);
 	}
+	if (d->dec.strip_end)
+		d->start_of_strip = true;
 
-	printf("\n");
+	TRACE("\n");
 
 	return 0;
 }
 
 void usage() {
-	printf("usage: carps-decode <file> [--header]\n");
+	printf("usage: carps-decode <file|-> [--header] [--trace] [--stdout]\n");
 }
 
 int main(int argc, char *argv[]) {
-	u8 buf[BUF_SIZE];
-	struct carps_header *header = (void *)buf;
-	u8 *data = buf + sizeof(struct carps_header);
+	static struct input in;
+	static struct decode d = { .compression = COMPRESS_CANON, .start_of_strip = true, .page = 1 };
+	struct carps_header *header;
+	u8 *data;
 	int ret;
 	u16 len;
-	FILE *fout = NULL;
 
 	if (argc < 2) {
 		usage();
 		return 1;
 	}
-	FILE *f = fopen(argv[1], "r");
+	FILE *f = strcmp(argv[1], "-") ? fopen(argv[1], "r") : stdin;
 	if (!f) {
 		perror("Unable to open file");
 		return 2;
 	}
 
-	if (argc > 2 && !strcmp(argv[2], "--header"))
-		output_header = true;
+	for (int i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "--header"))
+			output_header = true;
+		else if (!strcmp(argv[i], "--trace"))
+			trace = true;
+		else if (!strcmp(argv[i], "--stdout")) {
+			/* decoded data go to the original stdout, messages to stderr */
+			output = fdopen(dup(STDOUT_FILENO), "w");
+			if (!output || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+				perror("Unable to redirect output");
+				return 2;
+			}
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	/* height is known only at end of page and filled in later */
+	if (output && output_header && fseek(output, 0, SEEK_CUR)) {
+		fprintf(stderr, "--header needs seekable output, use it without --stdout or redirect stdout to a file\n");
+		return 1;
+	}
+	carps_decoder_init(&d.dec, stdout, trace);
+	carps_g4_decoder_init(&d.g4);
+	input_open(&in, f);
 
-	while (!feof(f)) {
-		ret = get_block(buf, f, 0);
+	for (;;) {
+		ret = get_block(&in, &header, &data, 0);
 		if (ret < 0)
 			break;
 		else
@@ -503,14 +494,12 @@ int main(int argc, char *argv[]) {
 			case CARPS_DOC_INFO_TITLE:
 				if (unknown != 0x11)
 					printf("!!!!!!!! ");
-				data[sizeof(struct carps_doc_info) + info->data_len] = '\x0';
-				printf("Title: '%s'\n", data + sizeof(struct carps_doc_info));
+				printf("Title: '%.*s'\n", info->data_len, data + sizeof(struct carps_doc_info));
 				break;
 			case CARPS_DOC_INFO_USER:
 				if (unknown != 0x11)
 					printf("!!!!!!!! ");
-				data[sizeof(struct carps_doc_info) + info->data_len] = '\x0';
-				printf("User: '%s'\n", data + sizeof(struct carps_doc_info));
+				printf("User: '%.*s'\n", info->data_len, data + sizeof(struct carps_doc_info));
 				break;
 			case CARPS_DOC_INFO_TIME:
 				print_time((void *)data + 2);
@@ -536,16 +525,14 @@ int main(int argc, char *argv[]) {
 						u16 unknown = be16_to_cpu(*(u16 *)info->data);
 						if (unknown != 0x11)
 							printf("!!!!!!!! ");
-						record[sizeof(struct carps_doc_info_new) + info->data_len + 3] = '\x0';
-						printf("Title: '%s'\n", record + sizeof(struct carps_doc_info_new) + 3);
+						printf("Title: '%.*s'\n", data_len - 3, record + sizeof(struct carps_doc_info_new) + 3);
 						break;
 					}
 					case CARPS_DOC_INFO_USER: {
 						u16 unknown = be16_to_cpu(*(u16 *)info->data);
 						if (unknown != 0x11)
 							printf("!!!!!!!! ");
-						record[sizeof(struct carps_doc_info_new) + info->data_len + 3] = '\x0';
-						printf("User: '%s'\n", record + sizeof(struct carps_doc_info_new) + 3);
+						printf("User: '%.*s'\n", data_len - 3, record + sizeof(struct carps_doc_info_new) + 3);
 						break;
 					}
 					case CARPS_DOC_INFO_TIME:
@@ -616,8 +603,8 @@ int main(int argc, char *argv[]) {
 			printf("\n");
 			break;
 		case CARPS_BLOCK_PRINT:
-			printf("PRINT DATA 0x%02x ", data[0]);
-			decode_print_data(data, len, f, &fout);
+			TRACE("PRINT DATA 0x%02x ", data[0]);
+			decode_print_data(&d, data, len, &in);
 			break;
 		default:
 			printf("UNKNOWN BLOCK 0x%02x !!!!!!!!\n", header->block_type);
@@ -626,10 +613,14 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	free(cur_line);
-	for (int i = 0; i < 8; i++)
-		free(last_lines[i]);
+	if (d.fout) {	/* no end of page */
+		end_page(&d);
+		close_output(d.fout);
+	}
+	carps_decoder_free(&d.dec);
+	carps_g4_decoder_free(&d.g4);
+	free(d.g4_data);
 
-	fclose(f);
+	input_close(&in);
 	return 0;
 }
@@ -0,0 +1,51 @@
+/* CUPS driver for Canon CARPS printers - helpers shared by the filter and carps-batch */
+/* Copyright (c) 2014 Ondrej Zary */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <time.h>
+#include "carps-util.h"
+
+uint64_t time_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+char *ppd_get(const struct job_options *jo, const char *name) {
+	if (!jo->ppd) {
+		const char *value = cupsGetOption(name, jo->num_options, jo->options);
+		return value ? (char *)value : "";
+	}
+
+	ppd_attr_t *attr = ppdFindAttr(jo->ppd, name, NULL);
+
+	if (attr)
+		return attr->value;
+	else {
+		ppd_choice_t *choice;
+		choice = ppdFindMarkedChoice(jo->ppd, name);
+		if (!choice)
+			return "";
+		return choice->choice;
+	}
+}
+
+void tuning_parse(struct job_options *jo) {
+	jo->num_tuning = cupsParseOptions(getenv("CARPS_TUNING"), 0, &jo->tuning);
+}
+
+char *tuning_get(const struct job_options *jo, const char *name) {
+	const char *value = cupsGetOption(name, jo->num_tuning, jo->tuning);
+
+	if (!value && jo->tuning_options)
+		value = cupsGetOption(name, jo->num_options, jo->options);
+
+	return value ? (char *)value : "";
+}
+
+void job_options_free(struct job_options *jo) {
+	cupsFreeOptions(jo->num_options, jo->options);
+	cupsFreeOptions(jo->num_tuning, jo->tuning);
+}
@@ -0,0 +1,33 @@
+/* CUPS driver for Canon CARPS printers - helpers shared by the filter and carps-batch */
+/* Copyright (c) 2014 Ondrej Zary */
+#ifndef CARPS_UTIL_H
+#define CARPS_UTIL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <cups/ppd.h>
+
+/* monotonic clock in ns, for statistics */
+uint64_t time_ns(void);
+
+/* PPD (NULL if none, e.g. PBM mode) and job options */
+struct job_options {
+	ppd_file_t *ppd;
+	int num_options;
+	cups_option_t *options;
+	/* server tuning from CARPS_TUNING environment variable, also from options if they are trusted */
+	int num_tuning;
+	cups_option_t *tuning;
+	bool tuning_options;
+};
+
+/* PPD attribute or marked choice, option value without PPD, "" if not set */
+char *ppd_get(const struct job_options *jo, const char *name);
+/* parse CARPS_TUNING environment variable (CUPS options) */
+void tuning_parse(struct job_options *jo);
+/* tuning option value, "" if not set */
+char *tuning_get(const struct job_options *jo, const char *name);
+/* free options and tuning */
+void job_options_free(struct job_options *jo);
+
+#endif
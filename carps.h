@@ -4,6 +4,7 @@
 #define u8 uint8_t
 #define u16 uint16_t
 #define u32 uint32_t
+#define u64 uint64_t
 
 #define POINTS_PER_INCH 72
 
@@ -21,15 +22,20 @@
 #define cpu_to_le16(x) le16_to_cpu(x)
 #define cpu_to_be16(x) (x)
 #define be16_to_cpu(x) (x)
+#define be64_to_cpu(x) (x)
 #else
 #define be16_to_cpu(x) ((((x) >> 8) & 0xff) | (((x) & 0xff) << 8))
 #define cpu_to_be16(x) be16_to_cpu(x)
+#define be64_to_cpu(x) __builtin_bswap64(x)
 #define cpu_to_le16(x) (x)
 #define le16_to_cpu(x) (x)
 #endif
 
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
 #define ROUND_UP_MULTIPLE(n, m) (((n) + (m) - 1) & ~((m) - 1))
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
 
 struct carps_header {
 	u8 magic1;	/* 0xCD */
@@ -113,6 +119,44 @@ struct carps_print_header {
 
 #define PRINT_DATA_XOR 0x43
 
+/* Canon print data tokens, codes are written MSB first */
+enum canon_code_type {
+	CODE_PREV,	/* bytes from previous line, number follows */
+	CODE_DICT,	/* byte from dictionary, 4-bit inverted index follows */
+	CODE_PREV8,	/* toggle previous line 3/7, precedes CODE_PREV */
+	CODE_IMMEDIATE,	/* byte immediate, 8 bits follow */
+	CODE_LAST,	/* bytes from this line at -1 or -2, number follows */
+	CODE_TWOBYTE,	/* toggle -1/-2, precedes CODE_LAST */
+	CODE_80,	/* bytes from this line at -80, number follows */
+	CODE_PREFIX,	/* number * 128 is added to the next count, number follows */
+	CODE_ZERO,	/* zero byte */
+	CODE_STRIP_END,	/* end of strip data */
+	CODE_INVALID,
+	NUM_CODES
+};
+
+struct canon_code {
+	u8 code;
+	u8 bits;
+	int next;	/* toggles are recognized only followed by the token they modify, -1 = none */
+};
+
+static const struct canon_code canon_codes[NUM_CODES] = {
+	[CODE_PREV]		= { 0b0,	1, -1 },
+	[CODE_DICT]		= { 0b10,	2, -1 },
+	[CODE_PREV8]		= { 0b110,	3, CODE_PREV },
+	[CODE_IMMEDIATE]	= { 0b1101,	4, -1 },
+	[CODE_LAST]		= { 0b1110,	4, -1 },
+	[CODE_TWOBYTE]		= { 0b11,	2, CODE_LAST },
+	[CODE_80]		= { 0b11110,	5, -1 },
+	[CODE_PREFIX]		= { 0b11111100,	8, -1 },
+	[CODE_ZERO]		= { 0b11111101,	8, -1 },
+	[CODE_STRIP_END]	= { 0b11111110,	8, -1 },
+	[CODE_INVALID]		= { 0b11111111,	8, -1 },
+};
+
+#define CODE_BITS(type)	(canon_codes[type].bits)
+
 enum carps_paper_weight {
 	WEIGHT_PLAIN_L	= 15,
 	WEIGHT_PLAIN	= 20,
@@ -141,12 +185,27 @@ enum carps_compression {
 	COMPRESS_G4	= 16,
 };
 
-const char *bin_n(u16 x, u8 n) {
-	static char b[9];
-	b[0] = '\0';
-
-	for (u16 i = 1 << (n - 1); i > 0; i >>= 1)
-		strcat(b, (x & i) ? "1" : "0");
-
-	return b;
-}
+/*
+ * Line history: current line and HISTORY_LINES previous lines in one contiguous slab used as
+ * a ring buffer indexed by line number, so advancing to the next line does not copy anything.
+ * Lines are HISTORY_ALIGN aligned and followed by at least HISTORY_PAD bytes that can be read
+ * (but not used) by wide compares running past the end of a line. A line can also be used
+ * where it is (e.g. in a mapped file) instead of being copied into its slot, then it has to
+ * stay there while it is in the history and be followed by HISTORY_PAD readable bytes too.
+ */
+#define HISTORY_LINES	8
+#define HISTORY_SLOTS	16	/* power of 2 >= HISTORY_LINES + 1 */
+#define HISTORY_ALIGN	64
+#define HISTORY_PAD	64
+
+struct line_history {
+	u8 *buf;	/* allocated memory */
+	u8 *slab;	/* first line, aligned */
+	u16 line_len;
+	unsigned int stride;
+	unsigned int line;	/* number of the current line */
+	const u8 *lines[HISTORY_SLOTS];	/* where the lines are, their slots or elsewhere */
+	u64 hash[HISTORY_SLOTS];	/* line hashes, valid only after history_hash_line() */
+	bool blank[HISTORY_SLOTS];	/* line is all zeros, valid only after history_hash_line() */
+	u64 blank_hash;		/* hash of a blank line */
+};
@@ -0,0 +1,2401 @@
+/* CUPS driver for Canon CARPS printers - encoder/decoder library */
+/* Copyright (c) 2014 Ondrej Zary */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcarps.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef DEBUG
+#define DBG(fmt, args ...)	fprintf(stderr, fmt, ##args);
+#else
+#define DBG(fmt, args ...)	do {} while (0)
+#endif
+
+/* 64-bit hash of a line, 32 bytes at a time in four independent lanes */
+#define HASH_MUL 0x9e3779b97f4a7c15ULL
+
+static u64 line_hash(const u8 *line, unsigned int len) {
+	u64 lane[4] = { len, 1, 2, 3 }, word;
+	unsigned int i;
+
+	for (i = 0; i + 32 <= len; i += 32)
+		for (int j = 0; j < 4; j++) {
+			memcpy(&word, line + i + 8 * j, 8);
+			lane[j] = (lane[j] ^ word) * HASH_MUL;
+			lane[j] ^= lane[j] >> 29;
+		}
+	for (int j = 0; i < len; i += 8, j++) {
+		word = 0;
+		memcpy(&word, line + i, (len - i < 8) ? len - i : 8);
+		lane[j] = (lane[j] ^ word) * HASH_MUL;
+		lane[j] ^= lane[j] >> 29;
+	}
+
+	return ((lane[0] * HASH_MUL ^ lane[1]) * HASH_MUL ^ lane[2]) * HASH_MUL ^ lane[3];
+}
+
+/* line contains only zero bytes, stops at the first non-zero chunk */
+static bool line_blank(const u8 *line, unsigned int len) {
+	unsigned int i = 0;
+	u64 word;
+
+#ifdef __SSE2__
+	/* 64 bytes at a time */
+	for (; i + 64 <= len; i += 64) {
+		__m128i x = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i *)(line + i)), _mm_loadu_si128((const __m128i *)(line + i + 16))),
+					 _mm_or_si128(_mm_loadu_si128((const __m128i *)(line + i + 32)), _mm_loadu_si128((const __m128i *)(line + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+#endif
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&word, line + i, 8);
+		if (word)
+			return false;
+	}
+	for (; i < len; i++)
+		if (line[i])
+			return false;
+
+	return true;
+}
+
+static int history_alloc(struct line_history *h, u16 line_len) {
+	h->line_len = line_len;
+	h->stride = ROUND_UP_MULTIPLE(line_len + HISTORY_PAD, HISTORY_ALIGN);
+	h->line = 0;
+	h->buf = calloc(1, HISTORY_SLOTS * h->stride + HISTORY_PAD + HISTORY_ALIGN);
+	if (!h->buf)
+		return -1;
+	h->slab = (u8 *)ROUND_UP_MULTIPLE((uintptr_t)h->buf, HISTORY_ALIGN);
+	for (int i = 0; i < HISTORY_SLOTS; i++)
+		h->lines[i] = h->slab + i * h->stride;
+	h->blank_hash = line_hash(h->slab, line_len);
+
+	return 0;
+}
+
+static void history_free(struct line_history *h) {
+	free(h->buf);
+	h->buf = h->slab = NULL;
+}
+
+/* line n lines back: 0 = current line, 1 = previous line, ... HISTORY_LINES */
+static const u8 *history_line(struct line_history *h, unsigned int n) {
+	return h->lines[(h->line - n) & (HISTORY_SLOTS - 1)];
+}
+
+/* slot of line n lines back to write the line into */
+static u8 *history_buf(struct line_history *h, unsigned int n) {
+	unsigned int slot = (h->line - n) & (HISTORY_SLOTS - 1);
+
+	h->lines[slot] = h->slab + slot * h->stride;
+	return h->slab + slot * h->stride;
+}
+
+/* current line is at line, not in its slot */
+static void history_set_line(struct line_history *h, const u8 *line) {
+	h->lines[h->line & (HISTORY_SLOTS - 1)] = line;
+}
+
+/* hash the current line after it is complete, blank lines are only detected, not hashed */
+static void history_hash_line(struct line_history *h) {
+	unsigned int slot = h->line & (HISTORY_SLOTS - 1);
+
+	h->blank[slot] = line_blank(history_line(h, 0), h->line_len);
+	h->hash[slot] = h->blank[slot] ? h->blank_hash : line_hash(history_line(h, 0), h->line_len);
+}
+
+static bool history_blank(struct line_history *h, unsigned int n) {
+	return h->blank[(h->line - n) & (HISTORY_SLOTS - 1)];
+}
+
+static u64 history_hash(struct line_history *h, unsigned int n) {
+	return h->hash[(h->line - n) & (HISTORY_SLOTS - 1)];
+}
+
+/* current line becomes the previous one */
+static void history_next(struct line_history *h) {
+	h->line++;
+}
+
+/*
+ * Move-to-front dictionary of recently used bytes. It starts filled with 0xaa so it contains
+ * duplicates: search finds the first one and add removes only the first one.
+ */
+#if defined(__SSE2__) && DICT_SIZE == 16
+/* whole dictionary in one register: compare + movemask to search, shift + blend to add */
+static int dict_search(u8 byte, u8 *dict) {
+	__m128i d = _mm_loadu_si128((__m128i *)dict);
+	int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_set1_epi8(byte)));
+
+	return mask ? __builtin_ctz(mask) : -1;
+}
+
+static void dict_add(u8 byte, u8 *dict) {
+	__m128i d = _mm_loadu_si128((__m128i *)dict);
+	int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(d, _mm_set1_epi8(byte)));
+	int pos = mask ? __builtin_ctz(mask) : DICT_SIZE - 1;
+	/* bytes 0..pos move one place up (dropping byte at pos), the rest stays */
+	__m128i up = _mm_cmplt_epi8(_mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm_set1_epi8(pos + 1));
+
+	d = _mm_or_si128(_mm_and_si128(up, _mm_slli_si128(d, 1)), _mm_andnot_si128(up, d));
+	_mm_storeu_si128((__m128i *)dict, _mm_or_si128(d, _mm_cvtsi32_si128(byte)));
+}
+#else
+static int dict_search(u8 byte, u8 *dict) {
+	for (int i = 0; i < DICT_SIZE; i++)
+		if (dict[i] == byte)
+			return i;
+
+	return -1;
+}
+
+static void dict_add(u8 byte, u8 *dict) {
+	int pos = dict_search(byte, dict);
+
+	if (pos < 0)
+		pos = DICT_SIZE - 1;
+	memmove(dict + 1, dict, pos);
+	dict[0] = byte;
+}
+#endif
+
+/* n low bits of x as a string of 0 and 1, b must have space for n + 1 chars */
+static char *bin_n(char *b, u16 x, u8 n) {
+	b[0] = '\0';
+
+	for (u16 i = 1 << (n - 1); i > 0; i >>= 1)
+		strcat(b, (x & i) ? "1" : "0");
+
+	return b;
+}
+
+void carps_fill_header(struct carps_header *header, u8 data_type, u8 block_type, u16 data_len) {
+	memset(header, 0, sizeof(struct carps_header));
+	header->magic1 = 0xCD;
+	header->magic2 = 0xCA;
+	header->magic3 = 0x10;
+	header->data_type = data_type;
+	header->block_type = block_type;
+	header->one = 0x01;
+	header->data_len = cpu_to_be16(data_len);
+}
+
+unsigned int carps_print_blocks_count(unsigned int headers_len, u32 len) {
+	if (headers_len + len <= MAX_DATA_LEN)
+		return 1;
+
+	return 1 + DIV_ROUND_UP(len - (MAX_DATA_LEN - headers_len), MAX_DATA_LEN - 1);
+}
+
+/* bytes added to data: block headers, strip headers and 0x01 of each continuing block */
+unsigned int carps_print_blocks_size(unsigned int headers_len, u32 len) {
+	unsigned int blocks = carps_print_blocks_count(headers_len, len);
+
+	return blocks * (sizeof(struct carps_header) + 1) + headers_len - 1;
+}
+
+unsigned int carps_print_blocks(struct carps_segment *seg, u8 *hdr, const u8 *headers, unsigned int headers_len, const u8 *data, u32 len) {
+	unsigned int n = 0;
+	/* first block: headers and as much data as fits */
+	u32 chunk = (headers_len + len > MAX_DATA_LEN) ? MAX_DATA_LEN - headers_len : len;
+
+	carps_fill_header((void *)hdr, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, headers_len + chunk);
+	memcpy(hdr + sizeof(struct carps_header), headers, headers_len);
+	seg[n++] = (struct carps_segment){ hdr, sizeof(struct carps_header) + headers_len };
+	seg[n++] = (struct carps_segment){ data, chunk };
+	hdr += sizeof(struct carps_header) + headers_len;
+	for (u32 pos = chunk; pos < len; pos += chunk) {
+		chunk = (len - pos > MAX_DATA_LEN - 1) ? MAX_DATA_LEN - 1 : len - pos;
+		carps_fill_header((void *)hdr, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, 1 + chunk);
+		hdr[sizeof(struct carps_header)] = 0x01;
+		seg[n++] = (struct carps_segment){ hdr, sizeof(struct carps_header) + 1 };
+		seg[n++] = (struct carps_segment){ data + pos, chunk };
+		hdr += sizeof(struct carps_header) + 1;
+	}
+
+	return n;
+}
+
+int carps_strip_headers(char *header, bool page_header, int dpi, int width, int num_lines, bool last, u32 len, enum carps_compression compression) {
+	int headers_len = 1;
+
+	header[0] = 0x01;
+	/* add page header at start of each page (except the first one) */
+	if (page_header)
+		headers_len += sprintf(header + headers_len, "\x1b[11h\x1b[?7;%d I\x1b[%d;1;0;%d;;%d;0'c", dpi, dpi, (compression == COMPRESS_G4) ? 256 : 32, (compression == COMPRESS_G4) ? 0 : 64);
+	if (compression == COMPRESS_G4) {
+		/* strip header */
+		headers_len += sprintf(header + headers_len, "\x1b[;%d;%d;16.P", width, num_lines);
+	} else {
+		/* strip header */
+		headers_len += sprintf(header + headers_len, "\x1b[;%d;%d;15.P", width, num_lines);
+		/* print data header */
+		struct carps_print_header *ph = (void *)header + headers_len;
+		memset(ph, 0, sizeof(struct carps_print_header));
+		ph->one = 0x01;
+		ph->two = 0x02;
+		ph->four = 0x04;
+		ph->eight = 0x08;
+		ph->magic = 0x50;
+		ph->last = last ? 0 : 1;
+		ph->data_len = cpu_to_le16(len);
+		headers_len += sizeof(struct carps_print_header);
+	}
+
+	return headers_len;
+}
+
+/*
+ * Job framing
+ */
+static enum carps_paper_size encode_paper_size(const char *paper_size_name) {
+	if (!strcmp(paper_size_name, "A4"))
+		return PAPER_A4;
+	else if (!strcmp(paper_size_name, "A5"))
+		return PAPER_A5;
+	else if (!strcmp(paper_size_name, "B5"))
+		return PAPER_B5;
+	else if (!strcmp(paper_size_name, "Letter"))
+		return PAPER_LETTER;
+	else if (!strcmp(paper_size_name, "Legal"))
+		return PAPER_LEGAL;
+	else if (!strcmp(paper_size_name, "Executive"))
+		return PAPER_EXECUTIVE;
+	else if (!strcmp(paper_size_name, "Monarch"))
+		return PAPER_ENV_MONAR;
+	else if (!strcmp(paper_size_name, "Env10"))
+		return PAPER_ENV_COM10;
+	else if (!strcmp(paper_size_name, "DL"))
+		return PAPER_ENV_DL;
+	else if (!strcmp(paper_size_name, "C5"))
+		return PAPER_ENV_C5;
+	else
+		return PAPER_CUSTOM;
+}
+
+void carps_fill_print_data_header(char *buf, unsigned int copies, unsigned int dpi, unsigned int weight, const char *paper_size_name, unsigned int paper_width, unsigned int paper_height, enum carps_compression compression) {
+	char tmp[100];
+	enum carps_paper_size paper_size = encode_paper_size(paper_size_name);
+
+//	\x01.%@.P42;600;1J;ImgColor.\.[11h.[?7;600 I.[20't.[14;;;;;;p.[?2h.[1v.[600;1;0;32;;64;0'c
+	buf[0] = 1;
+	buf[1] = 0;
+	strcat(buf, "\x1b%@");
+	/* ??? and resolution */
+	sprintf(tmp, "\x1bP42;%d;1J;ImgColor", dpi);
+	strcat(buf, tmp);
+	/* ??? */
+	strcat(buf, "\x1b\\");
+	/* ??? */
+	strcat(buf, "\x1b[11h");
+	/* ??? and resolution */
+	sprintf(tmp, "\x1b[?7;%d I", dpi);
+	strcat(buf, tmp);
+	/* paper weight */
+	sprintf(tmp, "\x1b[%d't", weight);
+	strcat(buf, tmp);
+	/* paper size */
+	if (paper_size == PAPER_CUSTOM) {
+		/* compute custom paper size in print dots */
+		int margin = 2 * dpi / 10;
+		paper_height = paper_height * dpi / POINTS_PER_INCH;
+		paper_width = paper_width * dpi / POINTS_PER_INCH;
+		sprintf(tmp, "\x1b[%d;%d;%d;%d;%d;%d;%dp", paper_size, paper_height, paper_width, margin, margin, margin, margin);
+	} else
+		sprintf(tmp, "\x1b[%d;;;;;;p", paper_size);
+	strcat(buf, tmp);
+	/* ??? */
+	strcat(buf, "\x1b[?2h");
+	/* number of copies */
+	sprintf(tmp, "\x1b[%dv", copies);
+	strcat(buf, tmp);
+	/* resolution and ??? */
+	sprintf(tmp, "\x1b[%d;1;0;%d;;%d;0'c", dpi, (compression == COMPRESS_G4) ? 256 : 32, (compression == COMPRESS_G4) ? 0 : 64);
+	strcat(buf, tmp);
+}
+
+static void fill_doc_time(struct carps_time *doc_time, struct tm *tm) {
+	doc_time->year = (1900 + tm->tm_year) >> 4;
+	doc_time->year_month = ((1900 + tm->tm_year) << 4) | (tm->tm_mon + 1);
+	doc_time->day = (tm->tm_mday << 3) | tm->tm_wday;
+	doc_time->hour = tm->tm_hour;
+	doc_time->min = tm->tm_min;
+	doc_time->sec_msec = tm->tm_sec << 2;
+}
+
+static void write_doc_info(carps_block_fn write_block, void *ctx, char *buf, const char *doc_title, const char *user_name, time_t timestamp) {
+	struct carps_doc_info *info = (void *)buf;
+	struct carps_time *doc_time;
+	/* document beginning */
+	u8 begin_data[] = { 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_BEGIN, begin_data, sizeof(begin_data));
+	/* document info - title */
+	info->type = cpu_to_be16(CARPS_DOC_INFO_TITLE);
+	info->unknown = cpu_to_be16(0x11);
+	info->data_len = strlen(doc_title) > 255 ? 255 : strlen(doc_title);
+	strncpy(buf + sizeof(struct carps_doc_info), doc_title, 255);
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_DOC_INFO, buf, sizeof(struct carps_doc_info) + info->data_len);
+	/* document info - user name */
+	info->type = cpu_to_be16(CARPS_DOC_INFO_USER);
+	info->unknown = cpu_to_be16(0x11);
+	info->data_len = strlen(user_name) > 255 ? 255 : strlen(user_name);
+	strncpy(buf + sizeof(struct carps_doc_info), user_name, 255);
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_DOC_INFO, buf, sizeof(struct carps_doc_info) + info->data_len);
+	/* document info - time */
+	struct tm tm_buf, *tm = gmtime_r(&timestamp, &tm_buf);
+	info->type = cpu_to_be16(CARPS_DOC_INFO_TIME);
+	doc_time = (void *)buf + 2;
+	memset(doc_time, 0, sizeof(struct carps_time));
+	if (timestamp)
+		fill_doc_time(doc_time, tm);
+	else {
+		/* MF5730 driver does not fill the time data, maybe because of a bug? */
+		/* Printer accepts data with time so we always fill it in. */
+		/* But we use this for test purposes so the output file does not change with time */
+		doc_time->day = 7;
+	}
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_DOC_INFO, buf, sizeof(struct carps_time) + 2);
+}
+
+static void write_doc_info_new(carps_block_fn write_block, void *ctx, char *buf, const char *doc_title, const char *user_name, time_t timestamp) {
+	char *ptr = buf;
+	struct carps_doc_info_new *info;
+	struct carps_time *doc_time;
+	int len;
+	/* 4 records */
+	u16 *record_count = (void *)ptr;
+	*record_count = cpu_to_be16(4);
+	ptr += 2;
+	/* unknown record */
+	info = (void *)ptr;
+	info->type = cpu_to_be16(0xf0);
+	info->data_len = cpu_to_be16(1);
+	info->data[0] = 0x01;
+	ptr += sizeof(struct carps_doc_info_new) + 1;
+	/* document info - title */
+	info = (void *)ptr;
+	info->type = cpu_to_be16(CARPS_DOC_INFO_TITLE);
+	len = strlen(doc_title) > 255 ? 255 : strlen(doc_title);
+	info->data_len = cpu_to_be16(len + 3);
+	info->data[0] = 0;
+	info->data[1] = 0x11;
+	info->data[2] = len;
+	strncpy((void *)&info->data[3], doc_title, 255);
+	ptr += sizeof(struct carps_doc_info_new) + 3 + len;
+	/* document info - user name */
+	info = (void *)ptr;
+	info->type = cpu_to_be16(CARPS_DOC_INFO_USER);
+	len = strlen(user_name) > 255 ? 255 : strlen(user_name);
+	info->data_len = cpu_to_be16(len + 3);
+	info->data[0] = 0;
+	info->data[1] = 0x11;
+	info->data[2] = len;
+	strncpy((void *)&info->data[3], user_name, 255);
+	ptr += sizeof(struct carps_doc_info_new) + 3 + len;
+	/* document info - time */
+	info = (void *)ptr;
+	info->type = cpu_to_be16(CARPS_DOC_INFO_TIME);
+	info->data_len = cpu_to_be16(sizeof(struct carps_time));
+	struct tm tm_buf, *tm = gmtime_r(&timestamp, &tm_buf);
+	doc_time = (void *)info->data;
+	memset(doc_time, 0, sizeof(struct carps_time));
+	if (timestamp)
+		fill_doc_time(doc_time, tm);
+	else {
+		/* MF5730 driver does not fill the time data, maybe because of a bug? */
+		/* Printer accepts data with time so we always fill it in. */
+		/* But we use this for test purposes so the output file does not change with time */
+		doc_time->day = 7;
+	}
+	ptr += sizeof(struct carps_doc_info_new) + sizeof(struct carps_time);
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_DOC_INFO_NEW, buf, ptr - buf);
+}
+
+void carps_job_begin(carps_block_fn write_block, void *ctx, const struct carps_job *job) {
+	/* title and user name up to 255 bytes each */
+	char buf[1024];
+	struct carps_print_params params;
+
+	if (job->new_doc_info)
+		write_doc_info_new(write_block, ctx, buf, job->title, job->user, job->timestamp);
+	else
+		write_doc_info(write_block, ctx, buf, job->title, job->user, job->timestamp);
+
+	/* begin 1 */
+	memset(buf, 0, 4);
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_BEGIN1, buf, 4);
+	/* begin 2 */
+	memset(buf, 0, 4);
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_BEGIN2, buf, 4);
+	/* print params - unknown  */
+	u8 unknown_param[] = { 0x00, 0x2e, 0x82, 0x00, 0x00 };
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_PARAMS, unknown_param, sizeof(unknown_param));
+	/* print params - image refinement */
+	params.magic = CARPS_PARAM_MAGIC;
+	params.param = CARPS_PARAM_IMAGEREFINE;
+	params.enabled = job->image_refinement;
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_PARAMS, &params, sizeof(params));
+	/* print params - toner save */
+	if (job->toner_save) {
+		params.param = CARPS_PARAM_TONERSAVE;
+		params.enabled = job->toner_save;
+		write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_PARAMS, &params, sizeof(params));
+	}
+}
+
+void carps_page_end(carps_block_fn write_block, void *ctx) {
+	u8 page_end[] = { 0x01, 0x0c };
+
+	write_block(ctx, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, page_end, sizeof(page_end));
+}
+
+void carps_job_end(carps_block_fn write_block, void *ctx) {
+	u8 zero = 0, one = 1;
+	/* end of print data */
+	u8 print_data_end[] = { 0x01, 0x1b, 'P', '0', 'J', 0x1b, '\\' };
+	write_block(ctx, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, print_data_end, sizeof(print_data_end));
+	/* end of print data */
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_PRINT, &one, 1);
+	/* end 2 */
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_END2, NULL, 0);
+	/* end 1 */
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_END1, NULL, 0);
+	/* end of document */
+	write_block(ctx, CARPS_DATA_CONTROL, CARPS_BLOCK_END, &zero, 1);
+}
+
+static void bw_init(struct bit_writer *bw, void *out, unsigned int size) {
+	bw->acc = 0;
+	bw->bits = 0;
+	bw->out = out;
+	bw->len = 0;
+	bw->size = size;
+	bw->overflow = false;
+}
+
+/* write out pending whole bytes, XORed */
+static void bw_flush(struct bit_writer *bw) {
+	while (bw->bits >= 8) {
+		bw->bits -= 8;
+		if (bw->len < bw->size)
+			bw->out[bw->len++] = (bw->acc >> bw->bits) ^ PRINT_DATA_XOR;
+		else
+			bw->overflow = true;
+	}
+}
+
+/* put n (up to 24) bits of data */
+static void put_bits(struct bit_writer *bw, u8 n, u32 bits) {
+	DBG("put_bits len=%d, pos=%d, n=%d, bits=%s\n", bw->len + bw->bits / 8, bw->bits % 8, n, bin_n((char [25]){ 0 }, bits, n));
+	bw->acc = (bw->acc << n) | (bits & MASK(n));
+	bw->bits += n;
+	if (bw->bits < 32)
+		return;
+	/* write 32 bits at once */
+	bw->bits -= 32;
+	if (bw->len + 4 <= bw->size) {
+		u32 word = (bw->acc >> bw->bits) ^ (PRINT_DATA_XOR * 0x01010101U);
+		bw->out[bw->len++] = word >> 24;
+		bw->out[bw->len++] = word >> 16;
+		bw->out[bw->len++] = word >> 8;
+		bw->out[bw->len++] = word;
+	} else {
+		/* write as much as fits */
+		bw->bits += 32;
+		bw_flush(bw);
+	}
+}
+
+/* fill unused bits in last byte with ones - a whole 0xff byte if there are no unused bits */
+static void bw_pad(struct bit_writer *bw) {
+	DBG("%d unused bits\n", 8 - bw->bits % 8);
+	put_bits(bw, 8 - bw->bits % 8, 0xff);
+}
+
+
+#define MATCH_WORDS(len)	(DIV_ROUND_UP(len, 64) + 1)	/* incl. zero word stopping ones_from() */
+#define MASK64(n)	((1ULL << (n)) - 1)
+
+/*
+ * set bit i of mask if a[i] == b[i], for i < n
+ * a and b are read in 64 byte chunks, up to HISTORY_PAD bytes past n
+ */
+static void match_mask_word(u64 *mask, const u8 *a, const u8 *b, int n) {
+	const u64 low7 = 0x7f7f7f7f7f7f7f7fULL;
+
+	if (n <= 0)
+		return;
+
+	for (int i = 0; i < n; i += 64) {
+		u64 m = 0;
+		for (int j = 0; j < 64; j += 8) {
+			u64 x, y;
+			memcpy(&x, a + i + j, 8);
+			memcpy(&y, b + i + j, 8);
+			x ^= y;
+			/* high bit of each equal (zero) byte, then gather them into the low 8 bits */
+			x = ~(((x & low7) + low7) | x | low7);
+#if defined(__BYTE_ORDER) && __BYTE_ORDER == __BIG_ENDIAN
+			x = __builtin_bswap64(x);
+#endif
+			m |= ((x >> 7) * 0x0102040810204080ULL) >> 56 << j;
+		}
+		mask[i / 64] = m;
+	}
+	if (n % 64)
+		mask[n / 64] &= MASK64(n % 64);
+}
+
+#ifdef __SSE2__
+/* compare 16 bytes at a time */
+static void match_mask_sse2(u64 *mask, const u8 *a, const u8 *b, int n) {
+	if (n <= 0)
+		return;
+	for (int i = 0; i < n; i += 64) {
+		u64 m = 0;
+		for (int j = 0; j < 64; j += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(a + i + j));
+			__m128i y = _mm_loadu_si128((const __m128i *)(b + i + j));
+			m |= (u64)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) << j;
+		}
+		mask[i / 64] = m;
+	}
+	if (n % 64)
+		mask[n / 64] &= MASK64(n % 64);
+}
+
+/* compare 32 bytes at a time */
+__attribute__((target("avx2")))
+static void match_mask_avx2(u64 *mask, const u8 *a, const u8 *b, int n) {
+	if (n <= 0)
+		return;
+	for (int i = 0; i < n; i += 64) {
+		__m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+		__m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)), _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+		mask[i / 64] = (u32)_mm256_movemask_epi8(lo) | (u64)(u32)_mm256_movemask_epi8(hi) << 32;
+	}
+	if (n % 64)
+		mask[n / 64] &= MASK64(n % 64);
+}
+#endif
+
+typedef void (*match_mask_fn)(u64 *mask, const u8 *a, const u8 *b, int n);
+
+/* pick the widest match_mask implementation supported by this CPU */
+static match_mask_fn match_mask_select(void) {
+	match_mask_fn match_mask = match_mask_word;
+#ifdef __SSE2__
+	match_mask = match_mask_sse2;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		match_mask = match_mask_avx2;
+#endif
+
+	return match_mask;
+}
+
+/* build match bitmap of current line against ref at the same position, positions below start never match */
+static void fill_matches(struct carps_encoder *se, u64 *match, const u8 *ref, int start) {
+	u16 line_len = se->line_len;
+	int words = MATCH_WORDS(line_len);
+
+	memset(match, 0, words * sizeof(u64));
+	/* line is too narrow for the offset: nothing matches */
+	if (start >= line_len)
+		return;
+	se->match_mask(match, se->cur_line + start, ref + start, line_len - start);
+	if (!start)
+		return;
+	/* shift the bitmap to start */
+	for (int w = words - 1; w >= 0; w--) {
+		int src = w - start / 64;
+		u64 m = 0;
+		if (src >= 0)
+			m = match[src] << (start % 64);
+		if (src >= 1 && start % 64)
+			m |= match[src - 1] >> (64 - start % 64);
+		match[w] = m;
+	}
+}
+
+/* number of consecutive set bits in bitmap starting at pos: remaining match length */
+static int ones_from(const u64 *match, int pos) {
+	int n;
+	u64 x;
+
+	match += pos / 64;
+	x = ~*match >> (pos % 64);
+	if (x)
+		return __builtin_ctzll(x);
+	/* long match: continue word by word, the zero word at the end stops it */
+	n = 64 - pos % 64;
+	while (!(x = ~*++match))
+		n += 64;
+
+	return n + __builtin_ctzll(x);
+}
+
+static void match_run_length(struct carps_encoder *se, u64 *match, int line_num, __attribute__((unused)) int param) {
+	u16 line_len = se->line_len;
+	/* a run of the same byte is a match with itself shifted by one */
+	fill_matches(se, match, se->cur_line - 1, 1);
+	/* first byte continues the run from the end of previous line */
+	if (line_num > 0 && se->cur_line[0] == history_line(&se->history, 1)[line_len - 1])	/* prevent -1 on first line */
+		match[0] |= 1;
+}
+
+static void match_prev(struct carps_encoder *se, u64 *match, int line_num, int num_last) {
+	u16 line_len = se->line_len;
+	if (line_num <= num_last)
+		memset(match, 0, MATCH_WORDS(line_len) * sizeof(u64));
+	else
+		fill_matches(se, match, history_line(&se->history, num_last + 1), 0);
+}
+
+static void match_this(struct carps_encoder *se, u64 *match, __attribute__((unused)) int line_num, int offset) {
+	fill_matches(se, match, se->cur_line + offset, -offset);
+}
+
+static int fls(unsigned int n) {
+	return n ? 31 - __builtin_clz(n) : 0;
+}
+
+static void encode_number(struct bit_writer *bw, int num) {
+	int num_bits;
+	DBG("encode_number(%d)\n", num);
+
+	if (num == 0) {
+		put_bits(bw, 6, 0b111111);
+		return;
+	}
+
+	if (num == 1) {
+		put_bits(bw, 2, 0b00);
+		return;
+	}
+
+	num_bits = fls(num);
+	DBG("num_bits=%d\n", num_bits);
+	if (num_bits == 1)
+		put_bits(bw, 2, 0b01);
+	else {
+		put_bits(bw, num_bits - 1, 0xff);
+		put_bits(bw, 1, 0b0);
+	}
+	put_bits(bw, num_bits, ~num & MASK(num_bits));
+}
+
+static void put_code(struct bit_writer *bw, enum canon_code_type type) {
+	put_bits(bw, canon_codes[type].bits, canon_codes[type].code);
+}
+
+static void encode_prefix(struct bit_writer *bw, int num) {
+	put_code(bw, CODE_PREFIX);
+	encode_number(bw, num / 128);
+}
+
+static void encode_last(struct bit_writer *bw, int count, __attribute__((unused)) bool *prev8_flag, bool *twobyte_flag, int num_last) {
+	bool twobyte_flag_change = (num_last == -1) ? *twobyte_flag : !*twobyte_flag;
+
+	*twobyte_flag = (num_last == -2);
+	if (count >= 128)
+		encode_prefix(bw, count);
+	count %= 128;
+	if (twobyte_flag_change)
+		put_code(bw, CODE_TWOBYTE);
+	put_code(bw, CODE_LAST);
+	encode_number(bw, count);
+}
+
+static void encode_prev(struct bit_writer *bw, int count, bool *prev8_flag, __attribute__((unused)) bool *twobyte_flag, int num_last) {
+	bool prev8_flag_change = (num_last == 3) ? *prev8_flag : !*prev8_flag;
+
+	*prev8_flag = (num_last == 7);
+	if (count >= 128)
+		encode_prefix(bw, count);
+	count %= 128;
+	if (prev8_flag_change)
+		put_code(bw, CODE_PREV8);
+	put_code(bw, CODE_PREV);
+	encode_number(bw, count);
+}
+
+static void encode_dict(struct bit_writer *bw, u8 pos) {
+	put_code(bw, CODE_DICT);
+	put_bits(bw, 4, ~pos & 0b1111);
+}
+
+static void encode_80(struct bit_writer *bw, int count, __attribute__((unused)) bool *prev8_flag, __attribute__((unused)) bool *twobyte_flag, __attribute__((unused)) int param) {
+	put_code(bw, CODE_80);
+	encode_number(bw, count);
+}
+
+/* number of bits written by encode_number() */
+static int number_bits(int num) {
+	if (num == 0)
+		return 6;
+	if (num == 1)
+		return 2;
+	if (num < 4)
+		return 3;
+
+	return 2 * fls(num);
+}
+
+/* number of bits written by encode_prefix() if count needs it */
+static int prefix_bits(int count) {
+	return (count >= 128) ? CODE_BITS(CODE_PREFIX) + number_bits(count / 128) : 0;
+}
+
+/* number of bits written by encode functions, flags are updated the same way */
+static int cost_last(int count, __attribute__((unused)) bool *prev8_flag, bool *twobyte_flag, int num_last) {
+	bool twobyte_flag_change = (num_last == -1) ? *twobyte_flag : !*twobyte_flag;
+
+	*twobyte_flag = (num_last == -2);
+
+	return prefix_bits(count) + (twobyte_flag_change ? CODE_BITS(CODE_TWOBYTE) : 0) + CODE_BITS(CODE_LAST) + number_bits(count % 128);
+}
+
+static int cost_prev(int count, bool *prev8_flag, __attribute__((unused)) bool *twobyte_flag, int num_last) {
+	bool prev8_flag_change = (num_last == 3) ? *prev8_flag : !*prev8_flag;
+
+	*prev8_flag = (num_last == 7);
+
+	return prefix_bits(count) + (prev8_flag_change ? CODE_BITS(CODE_PREV8) : 0) + CODE_BITS(CODE_PREV) + number_bits(count % 128);
+}
+
+static int cost_80(int count, __attribute__((unused)) bool *prev8_flag, __attribute__((unused)) bool *twobyte_flag, __attribute__((unused)) int param) {
+	return CODE_BITS(CODE_80) + number_bits(count);
+}
+
+/* whole line is blank and continues a blank run from the end of previous line */
+static bool repeat_run_length(struct carps_encoder *se, int line_num, __attribute__((unused)) int param) {
+	u16 line_len = se->line_len;
+	return line_num > 0 && history_blank(&se->history, 0) && history_line(&se->history, 1)[line_len - 1] == 0;
+}
+
+/* whole line is the same as line num_last + 1 above */
+static bool repeat_prev(struct carps_encoder *se, int line_num, int num_last) {
+	u16 line_len = se->line_len;
+	/* two blank lines are equal without comparing them */
+	return line_num > num_last && history_hash(&se->history, 0) == history_hash(&se->history, num_last + 1) &&
+	       ((history_blank(&se->history, 0) && history_blank(&se->history, num_last + 1)) ||
+		!memcmp(se->cur_line, history_line(&se->history, num_last + 1), line_len));
+}
+
+struct print_encoder {
+	char *name;
+	void (*get_matches)(struct carps_encoder *se, u64 *match, int line_num, int param);
+	bool (*repeats)(struct carps_encoder *se, int line_num, int param);	/* whole line matches (optional) */
+	int (*cost)(int count, bool *prev8_flag, bool *twobyte_flag, int param);
+	void (*encode)(struct bit_writer *bw, int count, bool *prev8_flag, bool *twobyte_flag, int param);
+	int param;
+	int max;	/* maximum count (0 = unlimited) */
+	int penalty;	/* extra bits counted by greedy encoder for changing a flag */
+};
+
+static const struct print_encoder encoders[NUM_ENCODERS] = {
+	{ .name = "@-80", .get_matches = match_this, .cost = cost_80, .encode = encode_80, .param = -80, .max = 127 },	/* does not use prefix: 127 is max */
+	{ .name = "run_len", .get_matches = match_run_length, .repeats = repeat_run_length, .cost = cost_last, .encode = encode_last, .param = -1, .penalty = 6 },
+	{ .name = "@-2", .get_matches = match_this, .cost = cost_last, .encode = encode_last, .param = -2, .penalty = 6 },
+	{ .name = "previous[3]", .get_matches = match_prev, .repeats = repeat_prev, .cost = cost_prev, .encode = encode_prev, .param = 3, .penalty = 7 },
+	{ .name = "previous[7]", .get_matches = match_prev, .repeats = repeat_prev, .cost = cost_prev, .encode = encode_prev, .param = 7, .penalty = 7 },
+};
+
+const char *carps_token_name(int token) {
+	const char *literals[] = { "dictionary", "zero", "immediate" };
+
+	return (token < NUM_ENCODERS) ? encoders[token].name : literals[token - NUM_ENCODERS];
+}
+
+/* token can encode a whole line */
+bool carps_token_repeats(int token) {
+	return token < NUM_ENCODERS && encoders[token].repeats;
+}
+
+/* number of bits written so far */
+static unsigned int bw_pos(struct bit_writer *bw) {
+	return bw->len * 8 + bw->bits;
+}
+
+static void count_token(struct carps_encoder *se, int token, unsigned int bits) {
+	se->stats.tokens[token]++;
+	se->stats.token_bits[token] += bits;
+}
+
+/* encode a byte as dictionary reference, zero byte or byte immediate, returns token type */
+static int encode_literal(struct bit_writer *bw, u8 byte, u8 *dictionary) {
+	int token;
+	/* dictionary */
+	int pos = dict_search(byte, dictionary);
+	if (pos >= 0) {
+		DBG("dict @%d\n", pos);
+		encode_dict(bw, pos);
+		token = TOKEN_DICT;
+	} else if (byte == 0x00) {
+		/* zero byte */
+		DBG("zero\n");
+		put_code(bw, CODE_ZERO);
+		token = TOKEN_ZERO;
+	} else {
+		/* fallback: byte immediate */
+		put_code(bw, CODE_IMMEDIATE);
+		put_bits(bw, 8, byte);
+		token = TOKEN_IMMEDIATE;
+	}
+	dict_add(byte, dictionary);
+
+	return token;
+}
+
+/* number of bits written by encode_literal() */
+static int literal_bits(u8 byte, u8 *dictionary) {
+	if (dict_search(byte, dictionary) >= 0)
+		return CODE_BITS(CODE_DICT) + 4;
+	if (byte == 0x00)
+		return CODE_BITS(CODE_ZERO);
+
+	return CODE_BITS(CODE_IMMEDIATE) + 8;
+}
+
+/* encode the whole line as a single token if possible, using the cheapest one */
+static bool encode_line_repeat(struct carps_encoder *se, struct bit_writer *bw, int line_num, bool *prev8_flag, bool *twobyte_flag) {
+	u16 line_len = se->line_len;
+	int best_bits = 0;
+	int best_encoder = -1;
+
+	for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++) {
+		if (!encoders[i].repeats || !encoders[i].repeats(se, line_num, encoders[i].param))
+			continue;
+		bool prev8 = *prev8_flag, twobyte = *twobyte_flag;
+		int bits = encoders[i].cost(line_len, &prev8, &twobyte, encoders[i].param);
+		if (best_encoder < 0 || bits < best_bits) {
+			best_bits = bits;
+			best_encoder = i;
+		}
+	}
+	if (best_encoder < 0)
+		return false;
+
+	DBG("Using %s for whole line\n", encoders[best_encoder].name);
+	unsigned int pos = bw_pos(bw);
+	encoders[best_encoder].encode(bw, line_len, prev8_flag, twobyte_flag, encoders[best_encoder].param);
+	count_token(se, best_encoder, bw_pos(bw) - pos);
+	se->stats.repeat_lines[best_encoder]++;
+	se->line_pos = line_len;
+
+	return true;
+}
+
+/* set bit i of candidates if any encoder can encode bytes i and i + 1, elsewhere only literals can be used */
+static void fill_candidates(struct carps_encoder *se) {
+	int words = MATCH_WORDS(se->line_len);
+
+	for (int w = 0; w < words - 1; w++) {
+		u64 c = 0;
+		for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++)
+			c |= se->match[i][w] & (se->match[i][w] >> 1 | se->match[i][w + 1] << 63);
+		se->candidates[w] = c;
+	}
+	se->candidates[words - 1] = 0;
+}
+
+/* at each position, use the method with best ratio of bytes encoded to bits used */
+static void encode_line_greedy(struct carps_encoder *se, struct bit_writer *bw, u8 *dictionary, bool *prev8_flag, bool *twobyte_flag) {
+	u16 line_len = se->line_len;
+	int count[NUM_ENCODERS], ratio[NUM_ENCODERS];
+
+	fill_candidates(se);
+	while (se->line_pos < line_len) {
+		DBG("line_pos=%d, outpos=%d: ", se->line_pos, bw->len + bw->bits / 8);
+		int best_ratio = 0;
+		int best_encoder;
+		/* try all compression methods where any of them can be used */
+		if (se->candidates[se->line_pos / 64] >> (se->line_pos % 64) & 1) {
+			for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++) {
+				int bits = 0;
+				count[i] = ones_from(se->match[i], se->line_pos);
+				if (encoders[i].max && count[i] > encoders[i].max)
+					count[i] = encoders[i].max;
+				if (count[i] > 1) {
+					bool prev8 = *prev8_flag, twobyte = *twobyte_flag;
+					bits = encoders[i].cost(count[i], &prev8, &twobyte, encoders[i].param);
+					if (prev8 != *prev8_flag || twobyte != *twobyte_flag)
+						bits += encoders[i].penalty;
+					ratio[i] = count[i] * 80 / bits;
+				} else
+					ratio[i] = 0;
+				DBG("%s=%d, %d bits, ratio=%d\n", encoders[i].name, count[i], bits, ratio[i]);
+			}
+			/* choose the best one */
+			for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++)
+				if (ratio[i] > best_ratio) {
+					best_ratio = ratio[i];
+					best_encoder = i;
+				}
+		}
+		unsigned int pos = bw_pos(bw);
+		/* if found, use it */
+		if (best_ratio) {
+			DBG("Using %s\n", encoders[best_encoder].name);
+			encoders[best_encoder].encode(bw, count[best_encoder], prev8_flag, twobyte_flag, encoders[best_encoder].param);
+			count_token(se, best_encoder, bw_pos(bw) - pos);
+			se->line_pos += count[best_encoder];
+			continue;
+		}
+		int token = encode_literal(bw, se->cur_line[se->line_pos], dictionary);
+		count_token(se, token, bw_pos(bw) - pos);
+		se->line_pos++;
+	}
+}
+
+/*
+ * Optimal parse: shortest path through the line where nodes are (position, flags) pairs and
+ * edges are tokens with their exact bit costs. Each node also keeps the dictionary reached by
+ * its best path, so literal costs follow the real dictionary contents. Matches never change
+ * the dictionary so nodes reached by a match only point to the dictionary of their source.
+ */
+#define PARSE_STATES	4	/* prev8_flag << 1 | twobyte_flag */
+#define PARSE_ALL_LEN	8	/* matches up to this long are tried at all lengths */
+#define PARSE_NICE_LEN	32	/* matches this long are not tried again from inside */
+
+struct parse_node {
+	int cost;	/* bits from line start, -1 = not reached */
+	u8 from;	/* state of previous node */
+	signed char encoder;	/* index to encoders[], -1 = literal */
+	u16 count;
+	u8 *dict;	/* dictionary after this node */
+	u8 dictionary[DICT_SIZE];	/* storage for dictionary changed by literal */
+};
+
+struct parse_token {
+	signed char encoder;
+	u16 count;
+};
+
+static bool parse_relax(struct parse_node *node, int cost, int from, int encoder, int count) {
+	if (node->cost >= 0 && node->cost <= cost)
+		return false;
+	node->cost = cost;
+	node->from = from;
+	node->encoder = encoder;
+	node->count = count;
+
+	return true;
+}
+
+static void parse_relax_match(struct parse_node *node, int from, unsigned int encoder, int count) {
+	bool prev8 = from >> 1, twobyte = from & 1;
+	int bits = encoders[encoder].cost(count, &prev8, &twobyte, encoders[encoder].param);
+	struct parse_node *next = node + count * PARSE_STATES - from + (prev8 << 1 | twobyte);
+
+	if (parse_relax(next, node->cost + bits, from, encoder, count))
+		next->dict = node->dict;
+}
+
+/*
+ * Any path from a node can be followed from another node at the same position with the same
+ * dictionary, paying at most for toggling the different flags once. Skip nodes where that is
+ * not more expensive.
+ */
+static bool parse_dominated(struct parse_node *node, int state) {
+	struct parse_node *first = node - state;
+
+	for (int s = 0; s < PARSE_STATES; s++) {
+		int toggle_bits = ((s ^ state) & 1 ? CODE_BITS(CODE_TWOBYTE) : 0) + ((s ^ state) & 2 ? CODE_BITS(CODE_PREV8) : 0);
+		if (s == state || first[s].cost < 0 || first[s].cost + toggle_bits > node->cost)
+			continue;
+		if (first[s].dict == node->dict || !memcmp(first[s].dict, node->dict, DICT_SIZE))
+			return true;
+	}
+
+	return false;
+}
+
+static void encode_line_optimal(struct carps_encoder *se, struct bit_writer *bw, u8 *dictionary, bool *prev8_flag, bool *twobyte_flag) {
+	u16 line_len = se->line_len;
+	int state = *prev8_flag << 1 | *twobyte_flag;
+	int num_tokens = 0;
+	int last_counts[ARRAY_SIZE(encoders)] = { 0 };
+	struct parse_node *node;
+
+	for (int i = 0; i < (line_len + 1) * PARSE_STATES; i++)
+		se->parse_nodes[i].cost = -1;
+	se->parse_nodes[state].cost = 0;
+	se->parse_nodes[state].dict = dictionary;
+
+	for (int pos = 0; pos < line_len; pos++) {
+		int counts[ARRAY_SIZE(encoders)];
+		bool skip[ARRAY_SIZE(encoders)];
+		for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++) {
+			counts[i] = ones_from(se->match[i], pos);
+			/* inside a long match that was already tried from its start */
+			skip[i] = (last_counts[i] >= PARSE_NICE_LEN && counts[i] == last_counts[i] - 1);
+			last_counts[i] = counts[i];
+			if (encoders[i].max && counts[i] > encoders[i].max)
+				counts[i] = encoders[i].max;
+		}
+		for (int s = 0; s < PARSE_STATES; s++) {
+			node = &se->parse_nodes[pos * PARSE_STATES + s];
+			if (node->cost < 0 || parse_dominated(node, s))
+				continue;
+			/* literal, changes only the dictionary */
+			struct parse_node *next = node + PARSE_STATES;
+			int bits = literal_bits(se->cur_line[pos], node->dict);
+			if (parse_relax(next, node->cost + bits, s, -1, 1)) {
+				memcpy(next->dictionary, node->dict, DICT_SIZE);
+				dict_add(se->cur_line[pos], next->dictionary);
+				next->dict = next->dictionary;
+			}
+			/* matches, change only the flags */
+			for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++) {
+				if (skip[i] || counts[i] < 2)
+					continue;
+				/* longer matches only at lengths where the cost changes */
+				int count;
+				for (count = 2; count <= counts[i] && count <= PARSE_ALL_LEN; count++)
+					parse_relax_match(node, s, i, count);
+				for (count = 2 * PARSE_ALL_LEN - 1; count < counts[i]; count = 2 * count + 1)
+					parse_relax_match(node, s, i, count);
+				if (counts[i] > PARSE_ALL_LEN)
+					parse_relax_match(node, s, i, counts[i]);
+			}
+		}
+	}
+
+	/* cheapest end state, then walk back to collect the tokens */
+	node = NULL;
+	for (int s = 0; s < PARSE_STATES; s++) {
+		struct parse_node *end = &se->parse_nodes[line_len * PARSE_STATES + s];
+		if (end->cost >= 0 && (!node || end->cost < node->cost)) {
+			node = end;
+			state = s;
+		}
+	}
+	DBG("optimal parse: %d bits\n", node->cost);
+	for (int pos = line_len; pos > 0; pos -= node->count) {
+		node = &se->parse_nodes[pos * PARSE_STATES + state];
+		se->parse_tokens[num_tokens].encoder = node->encoder;
+		se->parse_tokens[num_tokens].count = node->count;
+		num_tokens++;
+		state = node->from;
+	}
+
+	while (num_tokens--) {
+		struct parse_token *token = &se->parse_tokens[num_tokens];
+		unsigned int pos = bw_pos(bw);
+		if (token->encoder < 0) {
+			int literal = encode_literal(bw, se->cur_line[se->line_pos], dictionary);
+			count_token(se, literal, bw_pos(bw) - pos);
+		} else {
+			DBG("Using %s=%d\n", encoders[token->encoder].name, token->count);
+			encoders[token->encoder].encode(bw, token->count, prev8_flag, twobyte_flag, encoders[token->encoder].param);
+			count_token(se, token->encoder, bw_pos(bw) - pos);
+		}
+		se->line_pos += token->count;
+	}
+}
+
+void carps_encoder_free(struct carps_encoder *enc) {
+	history_free(&enc->history);
+	for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++) {
+		free(enc->match[i]);
+		enc->match[i] = NULL;
+	}
+	free(enc->candidates);
+	enc->candidates = NULL;
+	free(enc->parse_nodes);
+	free(enc->parse_tokens);
+	enc->parse_nodes = NULL;
+	enc->parse_tokens = NULL;
+}
+
+int carps_encoder_init(struct carps_encoder *enc, u16 line_len, bool max_compression, int strip_budget) {
+	enc->max_compression = max_compression;
+	enc->strip_budget = strip_budget;
+	enc->match_mask = match_mask_select();
+	if (enc->history.buf && enc->history.line_len == line_len)
+		return 0;
+	carps_encoder_free(enc);
+	enc->line_len = line_len;
+	enc->carry = false;
+	if (history_alloc(&enc->history, line_len))
+		return -1;
+	for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++) {
+		enc->match[i] = malloc(MATCH_WORDS(line_len) * sizeof(u64));
+		if (!enc->match[i])
+			return -1;
+	}
+	enc->candidates = malloc(MATCH_WORDS(line_len) * sizeof(u64));
+	if (!enc->candidates)
+		return -1;
+	enc->parse_nodes = malloc((line_len + 1) * PARSE_STATES * sizeof(struct parse_node));
+	enc->parse_tokens = malloc(line_len * sizeof(struct parse_token));
+	if (!enc->parse_nodes || !enc->parse_tokens)
+		return -1;
+
+	return 0;
+}
+
+/* lines in Canon strip: as much as fits into BUF_SIZE uncompressed, or a fixed grid with output budget */
+int carps_strip_lines(struct carps_encoder *enc, int height, bool *last) {
+	int num_lines = enc->strip_budget ? CARPS_BUDGET_STRIP_LINES : BUF_SIZE / enc->line_len;
+
+	*last = false;
+	if (num_lines >= height) {
+		DBG("num_lines := %d\n", height);
+		num_lines = height;
+		*last = true;
+	}
+
+	return num_lines;
+}
+
+/* block end marker, padding and last strip marker */
+#define STRIP_END_LEN	8
+
+u8 *carps_encoder_line(struct carps_encoder *enc) {
+	return history_buf(&enc->history, 0);
+}
+
+void carps_strip_begin(struct carps_encoder *enc, u8 *out, unsigned int size) {
+	bw_init(&enc->bw, out, size);
+	enc->budget = (enc->strip_budget && (unsigned int)enc->strip_budget < size) ? (unsigned int)enc->strip_budget : size;
+	memset(enc->dictionary, 0xaa, DICT_SIZE);
+	enc->prev8_flag = false;
+	enc->twobyte_flag = false;
+	enc->strip_lines = 0;
+	if (enc->carry) {
+		enc->carry = false;
+		carps_strip_push_line(enc);
+	}
+}
+
+/* encode line in carps_encoder_line(), false if it did not fit: it is kept for the next strip */
+bool carps_strip_push_line(struct carps_encoder *enc) {
+	struct bit_writer line_start = enc->bw;
+	struct encoder_stats stats_start = enc->stats;
+	int line_num = enc->strip_lines;
+
+	DBG("line_num=%d (total=%d)\n", line_num, enc->stats.lines);
+	enc->cur_line = history_line(&enc->history, 0);
+	enc->line_pos = 0;
+	history_hash_line(&enc->history);
+	if (!encode_line_repeat(enc, &enc->bw, line_num, &enc->prev8_flag, &enc->twobyte_flag)) {
+		/* compare the whole line at once, match lengths are then looked up from the bitmaps */
+		for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++)
+			encoders[i].get_matches(enc, enc->match[i], line_num, encoders[i].param);
+
+		if (enc->max_compression)
+			encode_line_optimal(enc, &enc->bw, enc->dictionary, &enc->prev8_flag, &enc->twobyte_flag);
+		else
+			encode_line_greedy(enc, &enc->bw, enc->dictionary, &enc->prev8_flag, &enc->twobyte_flag);
+	}
+	/* a strip has at least one line */
+	if (line_num > 0 && enc->bw.len + DIV_ROUND_UP(enc->bw.bits, 8) + STRIP_END_LEN > enc->budget) {
+		DBG("strip full\n");
+		enc->bw = line_start;
+		enc->stats = stats_start;
+		enc->carry = true;
+		return false;
+	}
+	history_next(&enc->history);
+	enc->line_pos = 0;
+	enc->strip_lines++;
+	enc->stats.lines++;
+
+	return true;
+}
+
+bool carps_strip_push_line_at(struct carps_encoder *enc, const u8 *line) {
+	history_set_line(&enc->history, line);
+	return carps_strip_push_line(enc);
+}
+
+u32 carps_strip_end(struct carps_encoder *enc, bool last) {
+	/* block end marker */
+	DBG("block end\n");
+	put_code(&enc->bw, CODE_STRIP_END);
+	put_bits(&enc->bw, 2, 0b00);
+	bw_pad(&enc->bw);
+
+	if (last) {
+		put_bits(&enc->bw, 8, 0xfe);
+		put_bits(&enc->bw, 8, 0x7f);
+		put_bits(&enc->bw, 8, 0xff);
+		put_bits(&enc->bw, 8, 0xff);
+	}
+	bw_flush(&enc->bw);
+
+	return enc->bw.len;
+}
+
+/*
+ * G4 (CCITT T.6) encoder producing the same data as LibTIFF with FILLORDER_LSB2MSB. Only the
+ * reference and coding lines are kept, the strip data are collected in a buffer that grows
+ * unless they are taken while encoding.
+ */
+#define G4_BUF_SIZE	(2 * MAX_DATA_LEN)	/* initial size: a block and codes of a line */
+
+struct g4_code {
+	u16 code;
+	u8 len;
+};
+
+/* terminating codes for runs 0..63 followed by makeup codes for runs 64..1728 */
+static const struct g4_code g4_white_codes[] = {
+	{ 0b00110101, 8 }, { 0b000111, 6 }, { 0b0111, 4 }, { 0b1000, 4 },
+	{ 0b1011, 4 }, { 0b1100, 4 }, { 0b1110, 4 }, { 0b1111, 4 },
+	{ 0b10011, 5 }, { 0b10100, 5 }, { 0b00111, 5 }, { 0b01000, 5 },
+	{ 0b001000, 6 }, { 0b000011, 6 }, { 0b110100, 6 }, { 0b110101, 6 },
+	{ 0b101010, 6 }, { 0b101011, 6 }, { 0b0100111, 7 }, { 0b0001100, 7 },
+	{ 0b0001000, 7 }, { 0b0010111, 7 }, { 0b0000011, 7 }, { 0b0000100, 7 },
+	{ 0b0101000, 7 }, { 0b0101011, 7 }, { 0b0010011, 7 }, { 0b0100100, 7 },
+	{ 0b0011000, 7 }, { 0b00000010, 8 }, { 0b00000011, 8 }, { 0b00011010, 8 },
+	{ 0b00011011, 8 }, { 0b00010010, 8 }, { 0b00010011, 8 }, { 0b00010100, 8 },
+	{ 0b00010101, 8 }, { 0b00010110, 8 }, { 0b00010111, 8 }, { 0b00101000, 8 },
+	{ 0b00101001, 8 }, { 0b00101010, 8 }, { 0b00101011, 8 }, { 0b00101100, 8 },
+	{ 0b00101101, 8 }, { 0b00000100, 8 }, { 0b00000101, 8 }, { 0b00001010, 8 },
+	{ 0b00001011, 8 }, { 0b01010010, 8 }, { 0b01010011, 8 }, { 0b01010100, 8 },
+	{ 0b01010101, 8 }, { 0b00100100, 8 }, { 0b00100101, 8 }, { 0b01011000, 8 },
+	{ 0b01011001, 8 }, { 0b01011010, 8 }, { 0b01011011, 8 }, { 0b01001010, 8 },
+	{ 0b01001011, 8 }, { 0b00110010, 8 }, { 0b00110011, 8 }, { 0b00110100, 8 },
+	/* 64.. */
+	{ 0b11011, 5 }, { 0b10010, 5 }, { 0b010111, 6 }, { 0b0110111, 7 },
+	{ 0b00110110, 8 }, { 0b00110111, 8 }, { 0b01100100, 8 }, { 0b01100101, 8 },
+	{ 0b01101000, 8 }, { 0b01100111, 8 }, { 0b011001100, 9 }, { 0b011001101, 9 },
+	{ 0b011010010, 9 }, { 0b011010011, 9 }, { 0b011010100, 9 }, { 0b011010101, 9 },
+	{ 0b011010110, 9 }, { 0b011010111, 9 }, { 0b011011000, 9 }, { 0b011011001, 9 },
+	{ 0b011011010, 9 }, { 0b011011011, 9 }, { 0b010011000, 9 }, { 0b010011001, 9 },
+	{ 0b010011010, 9 }, { 0b011000, 6 }, { 0b010011011, 9 },
+};
+
+static const struct g4_code g4_black_codes[] = {
+	{ 0b0000110111, 10 }, { 0b010, 3 }, { 0b11, 2 }, { 0b10, 2 },
+	{ 0b011, 3 }, { 0b0011, 4 }, { 0b0010, 4 }, { 0b00011, 5 },
+	{ 0b000101, 6 }, { 0b000100, 6 }, { 0b0000100, 7 }, { 0b0000101, 7 },
+	{ 0b0000111, 7 }, { 0b00000100, 8 }, { 0b00000111, 8 }, { 0b000011000, 9 },
+	{ 0b0000010111, 10 }, { 0b0000011000, 10 }, { 0b0000001000, 10 }, { 0b00001100111, 11 },
+	{ 0b00001101000, 11 }, { 0b00001101100, 11 }, { 0b00000110111, 11 }, { 0b00000101000, 11 },
+	{ 0b00000010111, 11 }, { 0b00000011000, 11 }, { 0b000011001010, 12 }, { 0b000011001011, 12 },
+	{ 0b000011001100, 12 }, { 0b000011001101, 12 }, { 0b000001101000, 12 }, { 0b000001101001, 12 },
+	{ 0b000001101010, 12 }, { 0b000001101011, 12 }, { 0b000011010010, 12 }, { 0b000011010011, 12 },
+	{ 0b000011010100, 12 }, { 0b000011010101, 12 }, { 0b000011010110, 12 }, { 0b000011010111, 12 },
+	{ 0b000001101100, 12 }, { 0b000001101101, 12 }, { 0b000011011010, 12 }, { 0b000011011011, 12 },
+	{ 0b000001010100, 12 }, { 0b000001010101, 12 }, { 0b000001010110, 12 }, { 0b000001010111, 12 },
+	{ 0b000001100100, 12 }, { 0b000001100101, 12 }, { 0b000001010010, 12 }, { 0b000001010011, 12 },
+	{ 0b000000100100, 12 }, { 0b000000110111, 12 }, { 0b000000111000, 12 }, { 0b000000100111, 12 },
+	{ 0b000000101000, 12 }, { 0b000001011000, 12 }, { 0b000001011001, 12 }, { 0b000000101011, 12 },
+	{ 0b000000101100, 12 }, { 0b000001011010, 12 }, { 0b000001100110, 12 }, { 0b000001100111, 12 },
+	/* 64.. */
+	{ 0b0000001111, 10 }, { 0b000011001000, 12 }, { 0b000011001001, 12 }, { 0b000001011011, 12 },
+	{ 0b000000110011, 12 }, { 0b000000110100, 12 }, { 0b000000110101, 12 }, { 0b0000001101100, 13 },
+	{ 0b0000001101101, 13 }, { 0b0000001001010, 13 }, { 0b0000001001011, 13 }, { 0b0000001001100, 13 },
+	{ 0b0000001001101, 13 }, { 0b0000001110010, 13 }, { 0b0000001110011, 13 }, { 0b0000001110100, 13 },
+	{ 0b0000001110101, 13 }, { 0b0000001110110, 13 }, { 0b0000001110111, 13 }, { 0b0000001010010, 13 },
+	{ 0b0000001010011, 13 }, { 0b0000001010100, 13 }, { 0b0000001010101, 13 }, { 0b0000001011010, 13 },
+	{ 0b0000001011011, 13 }, { 0b0000001100100, 13 }, { 0b0000001100101, 13 },
+};
+
+/* makeup codes for runs 1792..2560, same for both colors */
+static const struct g4_code g4_ext_codes[] = {
+	{ 0b00000001000, 11 }, { 0b00000001100, 11 }, { 0b00000001101, 11 }, { 0b000000010010, 12 },
+	{ 0b000000010011, 12 }, { 0b000000010100, 12 }, { 0b000000010101, 12 }, { 0b000000010110, 12 },
+	{ 0b000000010111, 12 }, { 0b000000011100, 12 }, { 0b000000011101, 12 }, { 0b000000011110, 12 },
+	{ 0b000000011111, 12 },
+};
+
+/* vertical mode codes for b1 - a1 = -3..3 */
+static const struct g4_code g4_vert_codes[] = {
+	{ 0b0000011, 7 }, { 0b000011, 6 }, { 0b011, 3 }, { 0b1, 1 }, { 0b010, 3 }, { 0b000010, 6 }, { 0b0000010, 7 },
+};
+
+#define G4_PASS		((struct g4_code) { 0b0001, 4 })
+#define G4_HORIZ	((struct g4_code) { 0b001, 3 })
+#define G4_EOL		((struct g4_code) { 0b000000000001, 12 })
+
+static u8 g4_reverse(u8 byte) {
+	byte = (byte & 0xf0) >> 4 | (byte & 0x0f) << 4;
+	byte = (byte & 0xcc) >> 2 | (byte & 0x33) << 2;
+	return (byte & 0xaa) >> 1 | (byte & 0x55) << 1;
+}
+
+/* write out pending whole bytes, bits reversed */
+static void g4_flush(struct carps_g4_encoder *g) {
+	while (g->bits >= 8) {
+		g->bits -= 8;
+		u8 byte = g4_reverse(g->acc >> g->bits);
+		if (g->len == g->size) {
+			u32 size = g->size ? 2 * g->size : G4_BUF_SIZE;
+			u8 *buf = realloc(g->buf, size);
+			if (!buf) {
+				/* the strip is lost, the rest is discarded */
+				g->error = true;
+				g->len = 0;
+				continue;
+			}
+			g->buf = buf;
+			g->size = size;
+		}
+		g->buf[g->len++] = byte;
+	}
+}
+
+static void g4_put(struct carps_g4_encoder *g, struct g4_code c) {
+	g->acc = (g->acc << c.len) | c.code;
+	g->bits += c.len;
+	if (g->bits >= 32)
+		g4_flush(g);
+}
+
+static void g4_put_run(struct carps_g4_encoder *g, int run, const struct g4_code *codes) {
+	while (run >= 2624) {
+		g4_put(g, g4_ext_codes[ARRAY_SIZE(g4_ext_codes) - 1]);
+		run -= 2560;
+	}
+	if (run >= 1792) {
+		g4_put(g, g4_ext_codes[(run - 1792) / 64]);
+		run %= 64;
+	} else if (run >= 64) {
+		g4_put(g, codes[63 + run / 64]);
+		run %= 64;
+	}
+	g4_put(g, codes[run]);
+}
+
+#define PIXEL(line, x)	(((line)[(x) >> 3] >> (7 - ((x) & 7))) & 1)
+
+/* first pixel at or after pos that is not color, end if there is none */
+static int g4_find_change(const u8 *line, int pos, int end, int color) {
+	u64 invert = color ? ~0ULL : 0, word;
+
+	while (pos < end) {
+		/* lines are padded so reading a whole word is always possible */
+		memcpy(&word, line + (pos >> 3), sizeof(word));
+		word = (be64_to_cpu(word) ^ invert) << (pos & 7);
+		if (word) {
+			pos += __builtin_clzll(word);
+			break;
+		}
+		pos += 64 - (pos & 7);
+	}
+
+	return (pos < end) ? pos : end;
+}
+
+/* encode line using the reference line, same decisions as LibTIFF Fax3Encode2DRow() */
+static void g4_encode_line(struct carps_g4_encoder *g, const u8 *line, const u8 *ref, int bits) {
+	int a0 = 0, a1, a2, b1, b2;
+
+	a1 = PIXEL(line, 0) ? 0 : g4_find_change(line, 0, bits, 0);
+	b1 = PIXEL(ref, 0) ? 0 : g4_find_change(ref, 0, bits, 0);
+	while (true) {
+		b2 = (b1 < bits) ? g4_find_change(ref, b1, bits, PIXEL(ref, b1)) : bits;
+		if (b2 >= a1) {
+			int d = b1 - a1;
+			if (d < -3 || d > 3) {
+				a2 = (a1 < bits) ? g4_find_change(line, a1, bits, PIXEL(line, a1)) : bits;
+				g4_put(g, G4_HORIZ);
+				if (a0 + a1 == 0 || !PIXEL(line, a0)) {
+					g4_put_run(g, a1 - a0, g4_white_codes);
+					g4_put_run(g, a2 - a1, g4_black_codes);
+				} else {
+					g4_put_run(g, a1 - a0, g4_black_codes);
+					g4_put_run(g, a2 - a1, g4_white_codes);
+				}
+				a0 = a2;
+			} else {
+				g4_put(g, g4_vert_codes[d + 3]);
+				a0 = a1;
+			}
+		} else {
+			g4_put(g, G4_PASS);
+			a0 = b2;
+		}
+		if (a0 >= bits)
+			break;
+		int color = PIXEL(line, a0);
+		a1 = g4_find_change(line, a0, bits, color);
+		b1 = g4_find_change(ref, a0, bits, !color);
+		b1 = g4_find_change(ref, b1, bits, color);
+	}
+}
+
+int carps_g4_init(struct carps_g4_encoder *g, int width) {
+	u16 line_len = CARPS_LINE_LEN(width);
+
+	g->width = width;
+	if (g->history.buf && g->history.line_len == line_len)
+		return 0;
+	history_free(&g->history);
+
+	return history_alloc(&g->history, line_len);
+}
+
+void carps_g4_free(struct carps_g4_encoder *g) {
+	history_free(&g->history);
+	free(g->buf);
+	g->buf = NULL;
+	g->len = g->size = 0;
+}
+
+void carps_g4_strip_begin(struct carps_g4_encoder *g) {
+	/* reference line for the first line is white */
+	memset(history_buf(&g->history, 1), 0, g->history.line_len);
+	g->acc = 0;
+	g->bits = 0;
+	g->len = 0;
+	g->error = false;
+	g->strip_lines = 0;
+}
+
+u8 *carps_g4_line(struct carps_g4_encoder *g) {
+	return history_buf(&g->history, 0);
+}
+
+void carps_g4_push_line(struct carps_g4_encoder *g) {
+	g4_encode_line(g, history_line(&g->history, 0), history_line(&g->history, 1), g->width);
+	history_next(&g->history);
+	g->strip_lines++;
+	g->lines++;
+}
+
+void carps_g4_push_line_at(struct carps_g4_encoder *g, const u8 *line) {
+	history_set_line(&g->history, line);
+	carps_g4_push_line(g);
+}
+
+void carps_g4_strip_finish(struct carps_g4_encoder *g) {
+	if (!g->strip_lines)
+		return;
+	/* end of facsimile block, padded with zeros */
+	g4_put(g, G4_EOL);
+	g4_put(g, G4_EOL);
+	g4_put(g, (struct g4_code) { 0, (8 - g->bits % 8) % 8 });
+	g4_flush(g);
+}
+
+u8 *carps_g4_take(struct carps_g4_encoder *g, u32 len) {
+	u8 *data = g->buf, *buf = NULL;
+
+	if (g->error)
+		return NULL;
+	if (len < g->len) {
+		buf = malloc(g->size);
+		if (!buf)
+			return NULL;
+		memcpy(buf, data + len, g->len - len);
+	}
+	g->buf = buf;
+	g->len -= len;
+	if (!buf)
+		g->size = 0;
+
+	return data;
+}
+
+u8 *carps_g4_strip_end(struct carps_g4_encoder *g, u32 *len) {
+	carps_g4_strip_finish(g);
+	*len = g->len;
+
+	return *len ? carps_g4_take(g, *len) : NULL;
+}
+
+/*
+ * Strip cache: hash table of entries that are also in a list from the most to the least
+ * recently used one, which is dropped first when the cache is full.
+ */
+#define STRIP_CACHE_BUCKETS	1024
+
+struct carps_cached_strip {
+	struct carps_cached_strip *hash_next;
+	struct carps_cached_strip *prev, *next;	/* LRU list */
+	struct carps_strip_key key;	/* lines point to data */
+	u32 len;
+	u8 data[];	/* lines followed by len bytes of strip data */
+};
+
+void carps_strip_key(struct carps_strip_key *key, const u8 *lines, u16 line_len, int num_lines, bool last, bool max_compression) {
+	memset(key, 0, sizeof(*key));
+	key->lines = lines;
+	key->hash = line_hash(lines, (unsigned int)num_lines * line_len);
+	key->line_len = line_len;
+	key->num_lines = num_lines;
+	key->last = last;
+	key->max_compression = max_compression;
+}
+
+static size_t strip_lines_size(const struct carps_strip_key *key) {
+	return (size_t)key->num_lines * key->line_len;
+}
+
+static bool strip_key_equal(const struct carps_strip_key *a, const struct carps_strip_key *b) {
+	return a->hash == b->hash && a->line_len == b->line_len && a->num_lines == b->num_lines &&
+	       a->last == b->last && a->max_compression == b->max_compression &&
+	       !memcmp(a->lines, b->lines, strip_lines_size(a));
+}
+
+static struct carps_cached_strip **strip_cache_bucket(struct carps_strip_cache *c, const struct carps_strip_key *key) {
+	return &c->buckets[key->hash % STRIP_CACHE_BUCKETS];
+}
+
+static void strip_cache_unlink(struct carps_strip_cache *c, struct carps_cached_strip *e) {
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+}
+
+static void strip_cache_push_front(struct carps_strip_cache *c, struct carps_cached_strip *e) {
+	e->prev = NULL;
+	e->next = c->head;
+	if (c->head)
+		c->head->prev = e;
+	else
+		c->tail = e;
+	c->head = e;
+}
+
+static void strip_cache_drop(struct carps_strip_cache *c, struct carps_cached_strip *e) {
+	struct carps_cached_strip **p = strip_cache_bucket(c, &e->key);
+
+	while (*p != e)
+		p = &(*p)->hash_next;
+	*p = e->hash_next;
+	strip_cache_unlink(c, e);
+	c->size -= sizeof(*e) + strip_lines_size(&e->key) + e->len;
+	free(e);
+}
+
+int carps_strip_cache_init(struct carps_strip_cache *c, size_t max_size) {
+	c->max_size = max_size;
+	c->buckets = calloc(STRIP_CACHE_BUCKETS, sizeof(struct carps_cached_strip *));
+
+	return c->buckets ? 0 : -1;
+}
+
+void carps_strip_cache_free(struct carps_strip_cache *c) {
+	while (c->head)
+		strip_cache_drop(c, c->head);
+	free(c->buckets);
+	c->buckets = NULL;
+}
+
+const u8 *carps_strip_cache_get(struct carps_strip_cache *c, const struct carps_strip_key *key, u32 *len) {
+	struct carps_cached_strip *e;
+
+	c->stats.lookups++;
+	for (e = *strip_cache_bucket(c, key); e; e = e->hash_next)
+		if (strip_key_equal(&e->key, key))
+			break;
+	if (!e)
+		return NULL;
+	c->stats.hits++;
+	c->stats.lines += key->num_lines;
+	strip_cache_unlink(c, e);
+	strip_cache_push_front(c, e);
+	*len = e->len;
+
+	return e->data + strip_lines_size(&e->key);
+}
+
+void carps_strip_cache_put(struct carps_strip_cache *c, const struct carps_strip_key *key, const u8 *data, u32 len) {
+	size_t lines_size = strip_lines_size(key);
+	size_t size = sizeof(struct carps_cached_strip) + lines_size + len;
+	struct carps_cached_strip *e, **bucket = strip_cache_bucket(c, key);
+
+	if (size > c->max_size)
+		return;
+	for (e = *bucket; e; e = e->hash_next)
+		if (strip_key_equal(&e->key, key))
+			return;
+	while (c->size + size > c->max_size)
+		strip_cache_drop(c, c->tail);
+	/* not cached if there is no memory */
+	e = malloc(size);
+	if (!e)
+		return;
+	e->key = *key;
+	e->key.lines = e->data;
+	e->len = len;
+	memcpy(e->data, key->lines, lines_size);
+	memcpy(e->data + lines_size, data, len);
+	e->hash_next = *bucket;
+	*bucket = e;
+	strip_cache_push_front(c, e);
+	c->size += size;
+}
+
+/*
+ * Stream: a strip is started by the first line pushed into it and finished when it has the
+ * planned number of lines, when a line does not fit or at the end of page. With a strip cache
+ * (and fixed strips), lines of a planned strip are buffered first and encoded only if the
+ * strip is not in the cache. G4 strip headers have the planned number of lines and the data
+ * are output in full print data blocks while encoding, so a strip the page ends in is padded
+ * with white lines.
+ */
+int carps_stream_init(struct carps_stream *s, bool max_compression, int strip_budget) {
+	s->compression = COMPRESS_CANON;
+	s->max_compression = max_compression;
+	s->strip_budget = strip_budget;
+	s->cur_page = 1;
+	s->strip = malloc(BUF_SIZE);
+
+	return s->strip ? 0 : -1;
+}
+
+int carps_stream_cache(struct carps_stream *s, struct carps_strip_cache *cache) {
+	s->cache = cache;
+	/* buffered lines are encoded in place */
+	if (!s->raster)
+		s->raster = malloc(BUF_SIZE + HISTORY_PAD);
+
+	return s->raster ? 0 : -1;
+}
+
+void carps_stream_g4(struct carps_stream *s, int strip_lines) {
+	s->compression = COMPRESS_G4;
+	s->g4_strip_lines = strip_lines;
+}
+
+void carps_stream_free(struct carps_stream *s) {
+	carps_encoder_free(&s->enc);
+	carps_g4_free(&s->g4);
+	free(s->strip);
+	free(s->raster);
+	s->strip = s->raster = NULL;
+	for (; s->done_pos < s->num_done; s->done_pos++)
+		free(s->done[s->done_pos].data);
+	free(s->done);
+	s->done = NULL;
+	s->num_done = s->done_size = s->done_pos = 0;
+}
+
+int carps_stream_page(struct carps_stream *s, int page, int width, int height, int dpi) {
+	s->page = page;
+	s->width = width;
+	s->dpi = dpi;
+	s->lines_left = height;
+	s->in_strip = false;
+	s->raster_lines = 0;
+
+	if (s->compression == COMPRESS_G4)
+		return carps_g4_init(&s->g4, width);
+
+	return carps_encoder_init(&s->enc, CARPS_LINE_LEN(width), s->max_compression, s->strip_budget);
+}
+
+/* lines are buffered for the cache lookup, not encoded right away */
+static bool stream_buffered(struct carps_stream *s) {
+	return s->cache && s->compression == COMPRESS_CANON && !s->strip_budget && !s->in_strip;
+}
+
+u8 *carps_stream_line(struct carps_stream *s) {
+	if (s->compression == COMPRESS_G4)
+		return carps_g4_line(&s->g4);
+	if (stream_buffered(s))
+		return s->raster + (size_t)s->raster_lines * s->enc.line_len;
+
+	return carps_encoder_line(&s->enc);
+}
+
+/* buffer for the next Canon strip, the previous one was handed over with its data */
+static int stream_strip_buf(struct carps_stream *s) {
+	if (!s->strip)
+		s->strip = malloc(BUF_SIZE);
+
+	return s->strip ? 0 : -1;
+}
+
+static int stream_strip_begin(struct carps_stream *s) {
+	if (stream_strip_buf(s))
+		return -1;
+	s->strip_lines = carps_strip_lines(&s->enc, s->lines_left, &s->last);
+	s->in_strip = true;
+	/* space for 0x80 strip data end marker */
+	carps_strip_begin(&s->enc, s->strip, BUF_SIZE - 1);
+
+	return 0;
+}
+
+/* add data (handed over) to the finished data, headers are filled in by the caller, NULL on error */
+static struct carps_stream_data *stream_data(struct carps_stream *s, u8 *data, u32 len) {
+	struct carps_stream_data *d;
+
+	if (s->num_done == s->done_size) {
+		unsigned int size = s->done_size ? 2 * s->done_size : 4;
+		d = realloc(s->done, size * sizeof(*d));
+		if (!d) {
+			free(data);
+			return NULL;
+		}
+		s->done = d;
+		s->done_size = size;
+	}
+	d = &s->done[s->num_done++];
+	d->data = data;
+	d->len = len;
+
+	return d;
+}
+
+/* strip headers, the page header is added to the first strip of a page */
+static unsigned int stream_headers(struct carps_stream *s, char *headers, int num_lines, bool last, u32 data_len) {
+	unsigned int len = carps_strip_headers(headers, s->page != s->cur_page, s->dpi, s->width, num_lines, last, data_len, s->compression);
+
+	s->cur_page = s->page;
+	s->strips++;
+	s->lines_left -= num_lines;
+
+	return len;
+}
+
+/* add strip headers and data (handed over) to the finished strips */
+static int stream_output(struct carps_stream *s, int num_lines, bool last, u8 *data, u32 len, u32 data_len) {
+	struct carps_stream_data *d = stream_data(s, data, len);
+
+	if (!d)
+		return -1;
+	d->headers_len = stream_headers(s, d->headers, num_lines, last, data_len);
+
+	return 0;
+}
+
+/* add Canon strip in s->strip to the finished strips */
+static int stream_strip_output(struct carps_stream *s, int num_lines, bool last, u32 len) {
+	u8 *data = s->strip;
+
+	data[len] = 0x80;	/* add strip data end marker */
+	s->strip = NULL;
+
+	return stream_output(s, num_lines, last, data, len + 1, len);
+}
+
+/* add full print data blocks of current G4 strip to the finished data, all data at strip end */
+static int stream_g4_output(struct carps_stream *s, bool end) {
+	for (;;) {
+		u32 max = MAX_DATA_LEN - (s->g4_headers_len ? s->g4_headers_len : 1);
+		u32 len = MIN(s->g4.len, max);
+		if (!len || (len < max && !end))
+			return 0;
+		u8 *data = carps_g4_take(&s->g4, len);
+		struct carps_stream_data *d = data ? stream_data(s, data, len) : NULL;
+		if (!d)
+			return -1;
+		if (s->g4_headers_len) {
+			memcpy(d->headers, s->g4_headers, s->g4_headers_len);
+			d->headers_len = s->g4_headers_len;
+			s->g4_headers_len = 0;
+		} else {
+			d->headers[0] = 0x01;	/* continuing block */
+			d->headers_len = 1;
+		}
+	}
+}
+
+/* encode line, NULL for carps_g4_line() */
+static int stream_g4_push_line(struct carps_stream *s, const u8 *line) {
+	if (!s->in_strip) {
+		s->strip_lines = (s->g4_strip_lines && s->g4_strip_lines < s->lines_left) ? s->g4_strip_lines : s->lines_left;
+		s->in_strip = true;
+		s->g4_headers_len = stream_headers(s, s->g4_headers, s->strip_lines, false, 0);
+		carps_g4_strip_begin(&s->g4);
+	}
+	if (line)
+		carps_g4_push_line_at(&s->g4, line);
+	else
+		carps_g4_push_line(&s->g4);
+	if (s->g4.strip_lines < s->strip_lines)
+		return stream_g4_output(s, false);
+	s->in_strip = false;
+	carps_g4_strip_finish(&s->g4);
+
+	return stream_g4_output(s, true);
+}
+
+static int stream_strip_finish(struct carps_stream *s, bool last) {
+	u32 len = carps_strip_end(&s->enc, last);
+
+	if (s->enc.bw.overflow)
+		s->overflow = true;
+	/* strip of buffered lines is cached only if they all fit into it */
+	else if (s->cache_put && s->enc.strip_lines == s->key.num_lines && last == s->key.last)
+		carps_strip_cache_put(s->cache, &s->key, s->strip, len);
+	s->cache_put = false;
+	s->in_strip = false;
+
+	return stream_strip_output(s, s->enc.strip_lines, last, len);
+}
+
+/* encode line, NULL for carps_encoder_line() */
+static int stream_encode_line(struct carps_stream *s, const u8 *line) {
+	if (!s->in_strip && stream_strip_begin(s))
+		return -1;
+	if (!(line ? carps_strip_push_line_at(&s->enc, line) : carps_strip_push_line(&s->enc))) {
+		/* continue in a new strip that starts with this line and ends where this one was planned to */
+		int num_lines = s->strip_lines - s->enc.strip_lines;
+		if (stream_strip_finish(s, false) || stream_strip_buf(s))
+			return -1;
+		s->strip_lines = num_lines;
+		s->in_strip = true;
+		carps_strip_begin(&s->enc, s->strip, BUF_SIZE - 1);
+	}
+	if (s->enc.strip_lines == s->strip_lines)
+		return stream_strip_finish(s, s->last);
+
+	return 0;
+}
+
+/* look up buffered lines in the cache, encode them if they are not there */
+static int stream_buffer_flush(struct carps_stream *s) {
+	u16 line_len = s->enc.line_len;
+	int num_lines = s->raster_lines;
+	const u8 *data;
+	u32 len;
+
+	s->raster_lines = 0;
+	carps_strip_key(&s->key, s->raster, line_len, num_lines, s->last, s->max_compression);
+	data = carps_strip_cache_get(s->cache, &s->key, &len);
+	if (data) {
+		if (stream_strip_buf(s))
+			return -1;
+		memcpy(s->strip, data, len);
+		return stream_strip_output(s, num_lines, s->last, len);
+	}
+	s->cache_put = true;
+	for (int i = 0; i < num_lines; i++)
+		if (stream_encode_line(s, s->raster + (size_t)i * line_len))
+			return -1;
+
+	return 0;
+}
+
+/* buffered line is already in raster */
+static int stream_buffer_line(struct carps_stream *s) {
+	if (!s->raster_lines++)
+		s->strip_lines = carps_strip_lines(&s->enc, s->lines_left, &s->last);
+	if (s->raster_lines == s->strip_lines)
+		return stream_buffer_flush(s);
+
+	return 0;
+}
+
+int carps_stream_push_line(struct carps_stream *s) {
+	if (s->compression == COMPRESS_G4)
+		return stream_g4_push_line(s, NULL);
+	if (!stream_buffered(s))
+		return stream_encode_line(s, NULL);
+
+	return stream_buffer_line(s);
+}
+
+int carps_stream_push_line_at(struct carps_stream *s, const u8 *line) {
+	if (s->compression == COMPRESS_G4)
+		return stream_g4_push_line(s, line);
+	if (!stream_buffered(s))
+		return stream_encode_line(s, line);
+	memcpy(carps_stream_line(s), line, s->enc.line_len);
+
+	return stream_buffer_line(s);
+}
+
+int carps_stream_page_end(struct carps_stream *s) {
+	if (s->compression == COMPRESS_G4) {
+		/* strip has the planned number of lines in its header, the rest is white */
+		while (s->in_strip) {
+			memset(carps_g4_line(&s->g4), 0, s->g4.history.line_len);
+			if (stream_g4_push_line(s, NULL))
+				return -1;
+		}
+		return 0;
+	}
+	if (s->raster_lines && stream_buffer_flush(s))
+		return -1;
+	if (s->in_strip)
+		return stream_strip_finish(s, s->last);
+
+	return 0;
+}
+
+bool carps_stream_pull(struct carps_stream *s, struct carps_stream_data *data) {
+	if (s->done_pos == s->num_done) {
+		s->done_pos = s->num_done = 0;
+		return false;
+	}
+	*data = s->done[s->done_pos++];
+
+	return true;
+}
+
+/*
+ * Decoder: tokens are decoded by peeking at the first bits of the bit reader and consuming
+ * the exact bit count. Decoding stops when a line is complete so it can be pulled.
+ */
+#define TRACE(d, fmt, args ...)	do { if ((d)->trace) fprintf((d)->log, fmt, ##args); } while (0)
+#define LOG_ERR(d, fmt, args ...)	do { if ((d)->log) fprintf((d)->log, fmt, ##args); } while (0)
+
+#define TOKEN_MAX_BITS	20	/* longest token: prefix + number */
+
+/* numbers are 00, 01x, 10xx, 110xxx, 1110xxxx, 11110xxxxx, 111110xxxxxx, 111111 (zero) */
+static struct number_entry number_decode(unsigned int bits) {
+	int ones = 0, num_bits;
+
+	while (ones < 6 && (bits & (1 << (NUMBER_PEEK - 1 - ones))))
+		ones++;
+	if (ones == 6)
+		return (struct number_entry){ 0, 6 };
+	if (ones == 0 && !(bits & (1 << (NUMBER_PEEK - 2))))
+		return (struct number_entry){ 1, 2 };
+	num_bits = ones ? ones + 1 : 1;
+	bits = (bits >> (NUMBER_PEEK - 2 * num_bits - (ones ? 0 : 1))) & MASK(num_bits);
+
+	return (struct number_entry){ (1 << num_bits) + (~bits & MASK(num_bits)), ones ? 2 * num_bits : 3 };
+}
+
+void carps_decoder_init(struct carps_decoder *d, FILE *log, bool trace) {
+	d->log = log;
+	d->trace = trace && log;
+	/* lookup tables from the codes shared with the encoder */
+	for (int type = 0; type < NUM_CODES; type++) {
+		const struct canon_code *c = &canon_codes[type];
+		int code = c->code, bits = c->bits;
+		if (c->next >= 0) {
+			code = (code << canon_codes[c->next].bits) | canon_codes[c->next].code;
+			bits += canon_codes[c->next].bits;
+		}
+		for (int i = 0; i < 1 << (8 - bits); i++)
+			d->code_table[(code << (8 - bits)) | i] = (struct code_entry){ type, c->bits };
+	}
+	for (int i = 0; i < 1 << NUMBER_PEEK; i++)
+		d->number_table[i] = number_decode(i);
+}
+
+void carps_decoder_free(struct carps_decoder *d) {
+	history_free(&d->history);
+}
+
+int carps_decoder_line_len(struct carps_decoder *d, u16 line_len) {
+	if (d->history.line_len != line_len || !d->history.buf) {
+		history_free(&d->history);
+		if (history_alloc(&d->history, line_len))
+			return -1;
+	}
+	d->line_len = line_len;
+	d->cur_line = history_buf(&d->history, 0);
+
+	return 0;
+}
+
+void carps_decoder_strip(struct carps_decoder *d) {
+	memset(d->dictionary, 0xaa, DICT_SIZE);
+	d->prev8_flag = d->twobyte_flag = false;
+	d->base = 0;
+	d->strip_end = false;
+	d->data = NULL;
+	d->len = 0;
+	d->last = false;
+	d->acc = 0;
+	d->bits = 0;
+}
+
+void carps_decoder_push(struct carps_decoder *d, const u8 *data, u32 len, long pos, bool last) {
+	d->data = data;
+	d->len = len;
+	d->pos = pos;
+	d->last = last;
+}
+
+/* load at least 57 bits if there is enough data */
+static void br_refill(struct carps_decoder *d) {
+	if (d->len >= 8) {
+		u64 word;
+		memcpy(&word, d->data, 8);
+		/* bits of a partially loaded byte are loaded again with the same value next time */
+		d->acc |= (be64_to_cpu(word) ^ (PRINT_DATA_XOR * 0x0101010101010101ULL)) >> d->bits;
+		int n = (63 - d->bits) / 8;
+		d->data += n;
+		d->len -= n;
+		d->pos += n;
+		d->bits += n * 8;
+	} else
+		while (d->bits <= 56 && d->len) {
+			d->acc |= (u64)(*d->data++ ^ PRINT_DATA_XOR) << (56 - d->bits);
+			d->len--;
+			d->pos++;
+			d->bits += 8;
+		}
+}
+
+/* next n bits, zeros past end of data */
+static u32 br_peek(struct carps_decoder *d, int n) {
+	return d->acc >> (64 - n);
+}
+
+static void br_consume(struct carps_decoder *d, int n) {
+	if (n > d->bits) {
+		LOG_ERR(d, "DATA UNDERFLOW\n");
+		n = d->bits;
+	}
+	d->acc <<= n;
+	d->bits -= n;
+}
+
+/* get n (up to 8) bits of data */
+static u8 get_bits(struct carps_decoder *d, int n) {
+	u8 bits = br_peek(d, n);
+	char b[9];
+
+	TRACE(d, "%s ", bin_n(b, bits, n));
+	br_consume(d, n);
+
+	return bits;
+}
+
+static int decode_number(struct carps_decoder *d) {
+	struct number_entry num = d->number_table[br_peek(d, NUMBER_PEEK)];
+
+	TRACE(d, "decode_number(%d bits) ", num.bits);
+	br_consume(d, num.bits);
+
+	return num.value;
+}
+
+/* bytes that fit into the current line, invalid data must not write past it */
+static int line_count(struct carps_decoder *d, int count) {
+	if (d->line_pos + count > d->line_len) {
+		LOG_ERR(d, "!!!!!!!! %d bytes past end of line\n", d->line_pos + count - d->line_len);
+		count = d->line_len - d->line_pos;
+	}
+
+	return count;
+}
+
+/* returns true if the line is complete */
+static bool line_advance(struct carps_decoder *d, int count) {
+	d->out_bytes += count;
+	d->line_pos += count;
+	if (d->line_pos < d->line_len)
+		return false;
+	history_next(&d->history);
+	d->cur_line = history_buf(&d->history, 0);
+	d->line_pos = 0;
+	d->line_num++;
+
+	return true;
+}
+
+static bool output_byte(struct carps_decoder *d, u8 byte) {
+	if (d->trace) {
+		fprintf(d->log, "DICTIONARY=");
+		for (int j = 0; j < DICT_SIZE; j++)
+			fprintf(d->log, "%02X ", d->dictionary[j]);
+		fprintf(d->log, "\n");
+	}
+
+	dict_add(byte, d->dictionary);
+	d->cur_line[d->line_pos] = byte;
+	TRACE(d, "BYTE=%x\n", byte);
+
+	return line_advance(d, 1);
+}
+
+static bool output_bytes_last(struct carps_decoder *d, int count, int offset) {
+	count = line_count(d, count);
+	for (int i = 0; i < count; i++) {
+		u8 byte;
+		if (d->line_pos + i - offset < 0)
+			byte = history_line(&d->history, 1)[d->line_len - offset];
+		else
+			byte = d->cur_line[d->line_pos + i - offset];
+		TRACE(d, "%02x ", byte);
+		d->cur_line[d->line_pos + i] = byte;
+	}
+	TRACE(d, "\n");
+
+	return line_advance(d, count);
+}
+
+static bool output_previous(struct carps_decoder *d, int line, int count) {
+	const u8 *prev = history_line(&d->history, line + 1);
+
+	count = line_count(d, count);
+	if (d->trace) {
+		fprintf(d->log, "previous (line=%d): ", line);
+		for (int i = 0; i < count; i++)
+			fprintf(d->log, "%02x ", prev[d->line_pos + i]);
+		fprintf(d->log, "\n");
+	}
+	memcpy(d->cur_line + d->line_pos, prev + d->line_pos, count);
+
+	return line_advance(d, count);
+}
+
+/* decode one token, returns true if it completed a line */
+static bool decode_token(struct carps_decoder *d) {
+	struct code_entry code = d->code_table[br_peek(d, 8)];
+	u8 bits = get_bits(d, code.bits);
+	char b[9];
+	int count;
+
+	switch (code.type) {
+	case CODE_ZERO:
+		TRACE(d, "zero byte\n");
+		return output_byte(d, 0);
+	case CODE_PREFIX:
+		count = decode_number(d);
+		TRACE(d, "PREFIX %d\n", count * 128);
+		d->base = count * 128;
+		break;
+	case CODE_STRIP_END:
+		TRACE(d, "strip end marker\n");
+		d->strip_end = true;
+		break;
+	case CODE_INVALID:
+		LOG_ERR(d, "!!!!!!!! 0b%s\n", bin_n(b, bits, 8));
+		break;
+	case CODE_TWOBYTE:
+		d->twobyte_flag = !d->twobyte_flag;
+		TRACE(d, "twobyte_flag := %d\n", d->twobyte_flag);
+		break;
+	case CODE_80:
+		count = decode_number(d);
+		TRACE(d, "%d bytes from this line [@-80]\n", count);
+		return output_bytes_last(d, count, 80);
+	case CODE_IMMEDIATE:
+		bits = get_bits(d, 8);
+		TRACE(d, "byte immediate 0b%s\n", bin_n(b, bits, 8));
+		return output_byte(d, bits);
+	case CODE_PREV8:
+		d->prev8_flag = !d->prev8_flag;
+		TRACE(d, "prev8_flag := %d\n", d->prev8_flag);
+		break;
+	case CODE_LAST:
+		count = decode_number(d) + d->base;
+		TRACE(d, "%d last bytes (+%d)\n", count, d->base);
+		d->base = 0;
+		return output_bytes_last(d, count, d->twobyte_flag ? 2 : 1);
+	case CODE_DICT:
+		bits = get_bits(d, 4);
+		TRACE(d, "[%d] byte from dictionary\n", (~bits & 0b1111));
+		return output_byte(d, d->dictionary[(~bits & 0b1111)]);
+	case CODE_PREV:
+		count = decode_number(d) + d->base;
+		TRACE(d, "%d bytes from previous line (+%d)\n", count, d->base);
+		d->base = 0;
+		return output_previous(d, d->prev8_flag ? 7 : 3, count);
+	}
+
+	return false;
+}
+
+const u8 *carps_decoder_pull_line(struct carps_decoder *d) {
+	while (!d->strip_end) {
+		br_refill(d);
+		/* a token is decoded only when all its bits are loaded */
+		if (d->bits < TOKEN_MAX_BITS && !d->last)
+			return NULL;
+		if (!d->bits)
+			return NULL;
+		TRACE(d, "out_pos: 0x%x, line_num=%d, line_pos=%d (%d), len=%d, in_pos=0x%lx ", d->out_bytes, d->line_num, d->line_pos, d->line_pos * 8,
+		      d->len + DIV_ROUND_UP(d->bits, 8), d->pos - DIV_ROUND_UP(d->bits, 8));
+		if (decode_token(d))
+			return history_line(&d->history, 1);
+	}
+
+	return NULL;
+}
+
+int carps_decoder_page_end(struct carps_decoder *d, const u8 **partial, u16 *len) {
+	int lines = d->line_num;
+
+	*partial = d->cur_line;
+	*len = d->line_pos;
+	d->line_pos = 0;
+	d->line_num = 0;
+
+	return lines;
+}
+
+/*
+ * G4 decoder: the coding line is decoded into its changing elements (positions where the color
+ * changes, first one to black), which are the reference for the next line.
+ */
+static void g4_table_add(struct g4_run_entry *table, struct g4_code c, int run) {
+	for (int i = 0; i < 1 << (G4_PEEK - c.len); i++)
+		table[c.code << (G4_PEEK - c.len) | i] = (struct g4_run_entry){ run, c.len };
+}
+
+void carps_g4_decoder_init(struct carps_g4_decoder *d) {
+	memset(d, 0, sizeof(*d));
+	for (unsigned int i = 0; i < ARRAY_SIZE(g4_white_codes); i++) {
+		int run = (i < 64) ? i : (i - 63) * 64;
+		g4_table_add(d->white_table, g4_white_codes[i], run);
+		g4_table_add(d->black_table, g4_black_codes[i], run);
+	}
+	for (unsigned int i = 0; i < ARRAY_SIZE(g4_ext_codes); i++) {
+		g4_table_add(d->white_table, g4_ext_codes[i], 1792 + 64 * i);
+		g4_table_add(d->black_table, g4_ext_codes[i], 1792 + 64 * i);
+	}
+}
+
+void carps_g4_decoder_free(struct carps_g4_decoder *d) {
+	free(d->ref);
+	free(d->cur);
+	d->ref = d->cur = NULL;
+	d->width = 0;
+}
+
+/* bit reader: bytes are loaded into acc MSB first, bits reversed, zeros past the end */
+struct g4_reader {
+	const u8 *data;
+	u32 len, pos;
+	u64 acc;
+	int bits;	/* number of loaded bits */
+};
+
+static unsigned int g4_peek(struct g4_reader *r, int n) {
+	for (; r->bits <= 56; r->bits += 8, r->pos++)
+		r->acc |= (u64)((r->pos < r->len) ? g4_reverse(r->data[r->pos]) : 0) << (56 - r->bits);
+
+	return r->acc >> (64 - n);
+}
+
+static void g4_skip(struct g4_reader *r, int n) {
+	r->acc <<= n;
+	r->bits -= n;
+}
+
+static bool g4_match(struct g4_reader *r, struct g4_code c) {
+	if (g4_peek(r, c.len) != c.code)
+		return false;
+	g4_skip(r, c.len);
+
+	return true;
+}
+
+/* run of one color: makeup codes followed by a terminating code, -1 if invalid */
+static int g4_get_run(struct g4_reader *r, const struct g4_run_entry *table) {
+	int run = 0;
+
+	for (;;) {
+		struct g4_run_entry e = table[g4_peek(r, G4_PEEK)];
+		if (!e.bits)
+			return -1;
+		g4_skip(r, e.bits);
+		run += e.run;
+		if (e.run < 64)
+			return run;
+	}
+}
+
+/* add changing element, one at the same position as the previous cancels it */
+static void g4_add_change(int *cur, int *n, int pos) {
+	if (*n && cur[*n - 1] == pos)
+		(*n)--;
+	else
+		cur[(*n)++] = pos;
+}
+
+static void g4_fill(u8 *line, int x, int end) {
+	for (; x < end && (x & 7); x++)
+		line[x >> 3] |= 0x80 >> (x & 7);
+	if (x + 8 <= end) {
+		memset(line + (x >> 3), 0xff, (end - x) >> 3);
+		x += (end - x) & ~7;
+	}
+	for (; x < end; x++)
+		line[x >> 3] |= 0x80 >> (x & 7);
+}
+
+/* decode a line into d->cur and line, false if the data are invalid or end */
+static bool g4_decode_line(struct carps_g4_decoder *d, struct g4_reader *r, int width, u8 *line) {
+	const int *ref = d->ref;
+	int *cur = d->cur;
+	int a0 = -1, color = 0, n = 0, k = 0;
+
+	while (a0 < width) {
+		/* b1: first changing element on reference line right of a0 with the opposite color */
+		if (k > 0)
+			k--;
+		while (ref[k] <= a0 || (k & 1) != color)
+			k++;
+		int b1 = ref[k], b2 = ref[k + 1];
+
+		if (g4_match(r, G4_PASS))
+			a0 = b2;
+		else if (g4_match(r, G4_HORIZ)) {
+			int run1 = g4_get_run(r, color ? d->black_table : d->white_table);
+			int run2 = g4_get_run(r, color ? d->white_table : d->black_table);
+			if (run1 < 0 || run2 < 0)
+				return false;
+			int a1 = MIN((a0 < 0 ? 0 : a0) + run1, width);
+			a0 = MIN(a1 + run2, width);
+			g4_add_change(cur, &n, a1);
+			g4_add_change(cur, &n, a0);
+		} else {
+			int d3;
+			for (d3 = 0; d3 < (int)ARRAY_SIZE(g4_vert_codes); d3++)
+				if (g4_match(r, g4_vert_codes[d3]))
+					break;
+			/* EOFB or invalid code */
+			if (d3 == ARRAY_SIZE(g4_vert_codes))
+				return false;
+			int a1 = b1 + 3 - d3;
+			if (a1 <= a0 || a1 > width)
+				return false;
+			g4_add_change(cur, &n, a1);
+			a0 = a1;
+			color = !color;
+		}
+	}
+	/* end of line must be white, both sentinel parities for the b1 search */
+	if (n & 1)
+		g4_add_change(cur, &n, width);
+	cur[n] = cur[n + 1] = cur[n + 2] = width;
+	for (int i = 0; i < n; i += 2)
+		g4_fill(line, cur[i], cur[i + 1]);
+
+	return true;
+}
+
+int carps_g4_decode(struct carps_g4_decoder *d, const u8 *data, u32 len, int width, int num_lines, u8 *lines) {
+	u16 line_len = CARPS_LINE_LEN(width);
+	struct g4_reader r = { .data = data, .len = len };
+	int num;
+
+	if (width > d->width) {
+		carps_g4_decoder_free(d);
+		/* changing elements are increasing positions 0..width, then sentinels */
+		d->ref = malloc((width + 4) * sizeof(int));
+		d->cur = malloc((width + 4) * sizeof(int));
+		if (!d->ref || !d->cur) {
+			carps_g4_decoder_free(d);
+			return -1;
+		}
+		d->width = width;
+	}
+	memset(lines, 0, (size_t)num_lines * line_len);
+	/* reference line of the first line is white */
+	d->ref[0] = d->ref[1] = d->ref[2] = width;
+	for (num = 0; num < num_lines; num++) {
+		if (!g4_decode_line(d, &r, width, lines + (size_t)num * line_len))
+			break;
+		int *tmp = d->ref;
+		d->ref = d->cur;
+		d->cur = tmp;
+	}
+
+	return num;
+}
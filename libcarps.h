@@ -0,0 +1,347 @@
+/* CUPS driver for Canon CARPS printers - encoder/decoder library */
+/* Copyright (c) 2014 Ondrej Zary */
+#ifndef LIBCARPS_H
+#define LIBCARPS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "carps.h"
+
+/*
+ * All state is kept in context structs owned by the caller, so any number of encoders and
+ * decoders can run in one process, each one used by one thread at a time. Structs must be
+ * zeroed before the first init call.
+ */
+
+/* block header */
+void carps_fill_header(struct carps_header *header, u8 data_type, u8 block_type, u16 data_len);
+
+/*
+ * Print data blocks: headers (starting with 0x01 byte) followed by data, each continuing
+ * block starts with 0x01 byte. carps_print_blocks() builds block headers with the headers
+ * and 0x01 bytes in hdr (carps_print_blocks_size() bytes) and fills seg with two segments
+ * per block, its part of hdr and its part of data, so the data are not copied. Returns the
+ * number of segments.
+ */
+struct carps_segment {
+	const u8 *data;
+	u32 len;
+};
+
+unsigned int carps_print_blocks_count(unsigned int headers_len, u32 len);
+unsigned int carps_print_blocks_size(unsigned int headers_len, u32 len);
+unsigned int carps_print_blocks(struct carps_segment *seg, u8 *hdr, const u8 *headers, unsigned int headers_len, const u8 *data, u32 len);
+
+/* strip header(s) starting with 0x01 byte, with page header if page_header is set, returns their length */
+#define CARPS_STRIP_HEADERS_LEN	128
+int carps_strip_headers(char *header, bool page_header, int dpi, int width, int num_lines, bool last, u32 len, enum carps_compression compression);
+
+/*
+ * Job framing: blocks before and after the print data of a job are passed to a write_block
+ * callback, data are valid only during the call.
+ */
+typedef void (*carps_block_fn)(void *ctx, u8 data_type, u8 block_type, const void *data, u16 data_len);
+
+struct carps_job {
+	const char *title, *user;	/* up to 255 bytes are used */
+	time_t timestamp;	/* 0 = fixed time, output does not change (for tests) */
+	bool new_doc_info;
+	u8 image_refinement;	/* CARPS_PARAM_ENABLED or CARPS_PARAM_DISABLED */
+	u8 toner_save;		/* CARPS_PARAM_ENABLED or CARPS_PARAM_DISABLED, 0 = printer default */
+};
+
+/* document info, begin blocks and print params */
+void carps_job_begin(carps_block_fn write_block, void *ctx, const struct carps_job *job);
+/* print data header (starting with 0x01 byte) sent as the first print block */
+void carps_fill_print_data_header(char *buf, unsigned int copies, unsigned int dpi, unsigned int weight, const char *paper_size_name, unsigned int paper_width, unsigned int paper_height, enum carps_compression compression);
+void carps_page_end(carps_block_fn write_block, void *ctx);
+/* end of print data and end blocks */
+void carps_job_end(carps_block_fn write_block, void *ctx);
+
+/* bytes of a line of width pixels as encoded */
+#define CARPS_LINE_LEN(width)	ROUND_UP_MULTIPLE(DIV_ROUND_UP(width, 8), 4)
+
+/*
+ * Canon encoder
+ */
+struct bit_writer {
+	u64 acc;	/* pending bits, last one in bit 0 */
+	int bits;	/* number of pending bits, < 32 between calls */
+	u8 *out;
+	unsigned int len;	/* number of bytes written to out */
+	unsigned int size;	/* capacity of out */
+	bool overflow;	/* output did not fit into out */
+};
+
+#define NUM_ENCODERS	5
+
+/* token types in statistics: encoders followed by literals */
+enum { TOKEN_DICT = NUM_ENCODERS, TOKEN_ZERO, TOKEN_IMMEDIATE, NUM_TOKENS };
+
+const char *carps_token_name(int token);
+/* token can encode a whole line */
+bool carps_token_repeats(int token);
+
+struct encoder_stats {
+	unsigned int lines;		/* number of lines encoded */
+	unsigned int repeat_lines[NUM_ENCODERS];	/* lines encoded as a single token */
+	unsigned int tokens[NUM_TOKENS];
+	u64 token_bits[NUM_TOKENS];
+};
+
+struct carps_encoder {
+	u16 line_len;
+	bool max_compression;	/* optimal parse instead of greedy */
+	int strip_budget;	/* output bytes per strip, 0 = whole output buffer */
+	void (*match_mask)(u64 *mask, const u8 *a, const u8 *b, int n);
+	struct line_history history;
+	const u8 *cur_line;
+	u16 line_pos;
+	u64 *match[NUM_ENCODERS];	/* bit i set if byte i of current line can be encoded by encoder n */
+	u64 *candidates;	/* bit i set if any encoder can encode bytes i and i + 1 */
+	struct parse_node *parse_nodes;	/* (line_len + 1) * PARSE_STATES */
+	struct parse_token *parse_tokens;	/* line_len */
+	struct encoder_stats stats;
+	bool carry;		/* current line did not fit into the previous strip */
+	/* current strip */
+	struct bit_writer bw;
+	unsigned int budget;
+	u8 dictionary[DICT_SIZE];
+	bool prev8_flag, twobyte_flag;
+	int strip_lines;	/* lines encoded */
+};
+
+/* (re)allocate for line_len, keeps the buffers if it is the same, returns -1 on error */
+int carps_encoder_init(struct carps_encoder *enc, u16 line_len, bool max_compression, int strip_budget);
+void carps_encoder_free(struct carps_encoder *enc);
+/*
+ * Lines in a strip for a page with height lines left, last is set if it covers all of them.
+ * Strips are planned on this grid: one closed early by a line that does not fit is continued
+ * up to its planned end, so the strips do not depend on how the page is split for encoding.
+ */
+#define CARPS_BUDGET_STRIP_LINES	1024	/* with strip_budget */
+int carps_strip_lines(struct carps_encoder *enc, int height, bool *last);
+
+/*
+ * Strips: carps_strip_begin() starts a strip in out (encoding the carried line, if any), then
+ * each line is written to carps_encoder_line() and encoded by carps_strip_push_line(). When a
+ * line does not fit into the budget, it returns false and the line is carried to the next
+ * strip. carps_strip_end() ends the strip and returns its length (without 0x80 end marker).
+ * carps_strip_push_line_at() encodes a line where it is instead, it must stay there until
+ * HISTORY_LINES more lines are pushed or the strip it is carried to begins and be followed by
+ * HISTORY_PAD readable bytes.
+ */
+void carps_strip_begin(struct carps_encoder *enc, u8 *out, unsigned int size);
+u8 *carps_encoder_line(struct carps_encoder *enc);
+bool carps_strip_push_line(struct carps_encoder *enc);
+bool carps_strip_push_line_at(struct carps_encoder *enc, const u8 *line);
+u32 carps_strip_end(struct carps_encoder *enc, bool last);
+
+/*
+ * G4 (CCITT T.6) encoder: strips are started by carps_g4_strip_begin() (reference line is
+ * white), then each line is written to carps_g4_line() and encoded by carps_g4_push_line(),
+ * or encoded where it is by carps_g4_push_line_at() (kept until the next line is pushed).
+ * carps_g4_strip_end() returns the strip data (freed by the caller) and its length, NULL if
+ * there are no lines or the data could not be allocated. To send data while the strip is
+ * encoded, carps_g4_take() hands over the first len of the g->len pending bytes (freed by
+ * the caller) and keeps the rest, carps_g4_strip_finish() ends the strip for taking the rest.
+ */
+struct carps_g4_encoder {
+	int width;
+	struct line_history history;	/* current and reference line */
+	u64 acc;	/* pending bits, last one in bit 0 */
+	int bits;	/* number of pending bits, < 32 between calls */
+	u8 *buf;	/* strip data */
+	u32 len, size;
+	bool error;	/* strip data could not be allocated */
+	int strip_lines;	/* lines encoded in current strip */
+	unsigned int lines;	/* lines encoded in all strips */
+};
+
+/* (re)allocate for width, keeps the buffers if the line length is the same, returns -1 on error */
+int carps_g4_init(struct carps_g4_encoder *g, int width);
+void carps_g4_free(struct carps_g4_encoder *g);
+void carps_g4_strip_begin(struct carps_g4_encoder *g);
+u8 *carps_g4_line(struct carps_g4_encoder *g);
+void carps_g4_push_line(struct carps_g4_encoder *g);
+void carps_g4_push_line_at(struct carps_g4_encoder *g, const u8 *line);
+u8 *carps_g4_strip_end(struct carps_g4_encoder *g, u32 *len);
+void carps_g4_strip_finish(struct carps_g4_encoder *g);
+u8 *carps_g4_take(struct carps_g4_encoder *g, u32 len);
+
+/*
+ * Strip cache: the encoder state is reset for each strip, so a strip with the same lines
+ * always encodes to the same data (as returned by carps_strip_end()). Encoded strips are kept
+ * with their lines up to max_size bytes, the least recently used ones are dropped. The hash
+ * only finds candidates, a strip is found if its lines are equal. Not thread safe.
+ */
+struct carps_strip_key {
+	const u8 *lines;	/* num_lines * line_len bytes, must be valid until get or put returns */
+	u64 hash;	/* of all lines */
+	u16 line_len;
+	int num_lines;
+	bool last;
+	bool max_compression;
+};
+
+struct carps_strip_cache_stats {
+	unsigned int lookups, hits;
+	u64 lines;	/* lines of strips found */
+};
+
+struct carps_strip_cache {
+	size_t max_size, size;
+	struct carps_cached_strip **buckets;
+	struct carps_cached_strip *head, *tail;	/* most and least recently used */
+	struct carps_strip_cache_stats stats;
+};
+
+int carps_strip_cache_init(struct carps_strip_cache *c, size_t max_size);
+void carps_strip_cache_free(struct carps_strip_cache *c);
+void carps_strip_key(struct carps_strip_key *key, const u8 *lines, u16 line_len, int num_lines, bool last, bool max_compression);
+/* cached strip data, valid until the next put, NULL if not found */
+const u8 *carps_strip_cache_get(struct carps_strip_cache *c, const struct carps_strip_key *key, u32 *len);
+void carps_strip_cache_put(struct carps_strip_cache *c, const struct carps_strip_key *key, const u8 *data, u32 len);
+
+/*
+ * Print data stream: lines of a page are pushed, finished strips are pulled as their headers
+ * and data, to be sent in print data blocks. Strip data are not copied, each finished strip
+ * hands over its buffer. Canon compression unless carps_stream_g4() is used.
+ */
+struct carps_stream_data {
+	char headers[CARPS_STRIP_HEADERS_LEN];
+	unsigned int headers_len;
+	u8 *data;	/* freed by the caller */
+	u32 len;
+};
+
+struct carps_stream {
+	enum carps_compression compression;
+	struct carps_encoder enc;
+	struct carps_g4_encoder g4;
+	int g4_strip_lines;	/* G4: lines per strip, 0 = whole page */
+	char g4_headers[CARPS_STRIP_HEADERS_LEN];	/* G4: headers of current strip */
+	unsigned int g4_headers_len;	/* not output yet, 0 = output */
+	bool max_compression;
+	int strip_budget;
+	int width, dpi;
+	int page, cur_page;	/* page header is added to the first strip of each page except the first */
+	int lines_left;		/* lines of page not in a finished strip */
+	int strip_lines;	/* lines planned for current strip */
+	bool last;		/* current strip is the last one of the page */
+	bool in_strip;
+	bool overflow;		/* a strip did not fit into the buffer and was truncated */
+	u8 *strip;		/* BUF_SIZE, NULL after it was handed over */
+	struct carps_stream_data *done;	/* finished strips, pulled from done_pos */
+	unsigned int num_done, done_size, done_pos;
+	unsigned int strips;	/* strips finished */
+	/* strip cache, lines are buffered in raster (BUF_SIZE) before lookup */
+	struct carps_strip_cache *cache;
+	u8 *raster;
+	int raster_lines;
+	struct carps_strip_key key;	/* of buffered lines */
+	bool cache_put;		/* add strip being encoded from buffered lines to the cache */
+};
+
+int carps_stream_init(struct carps_stream *s, bool max_compression, int strip_budget);
+/* use strip cache (ignored with strip_budget or G4), returns -1 on error */
+int carps_stream_cache(struct carps_stream *s, struct carps_strip_cache *cache);
+/* use G4 compression with strips of strip_lines lines (0 = whole page), before the first page */
+void carps_stream_g4(struct carps_stream *s, int strip_lines);
+void carps_stream_free(struct carps_stream *s);
+/* start page, returns -1 on error */
+int carps_stream_page(struct carps_stream *s, int page, int width, int height, int dpi);
+/* buffer for the next line, CARPS_LINE_LEN(width) bytes */
+u8 *carps_stream_line(struct carps_stream *s);
+/* encode the line, returns -1 on error */
+int carps_stream_push_line(struct carps_stream *s);
+/*
+ * encode line where it is instead of copying it into carps_stream_line() (only the strip cache
+ * copies it), see carps_strip_push_line_at(), returns -1 on error
+ */
+int carps_stream_push_line_at(struct carps_stream *s, const u8 *line);
+/* finish the last strip of the page, even if not all lines were pushed (G4: padded with white lines), returns -1 on error */
+int carps_stream_page_end(struct carps_stream *s);
+/* next finished strip, false if there is none */
+bool carps_stream_pull(struct carps_stream *s, struct carps_stream_data *data);
+
+/*
+ * Canon decoder
+ */
+struct code_entry {
+	u8 type;
+	u8 bits;
+};
+
+#define NUMBER_PEEK	12	/* longest number */
+struct number_entry {
+	u8 value;
+	u8 bits;
+};
+
+struct carps_decoder {
+	FILE *log;	/* invalid data and trace messages, NULL = none */
+	bool trace;	/* print bits and tokens */
+	struct line_history history;
+	u8 *cur_line;
+	u16 line_len, line_pos;
+	int line_num;	/* complete lines of page */
+	int out_bytes;
+	/* current strip */
+	u8 dictionary[DICT_SIZE];
+	bool prev8_flag, twobyte_flag;
+	int base;	/* count from prefix */
+	bool strip_end;	/* strip end marker found */
+	/* bit reader: pushed data are loaded into acc (MSB first, XOR removed) */
+	const u8 *data;
+	u32 len;	/* bytes not loaded yet */
+	long pos;	/* input offset of data */
+	bool last;	/* no more data in strip */
+	u64 acc;
+	int bits;	/* number of loaded bits */
+	/* lookup tables for first 8 bits of a token and first NUMBER_PEEK bits of a number */
+	struct code_entry code_table[256];
+	struct number_entry number_table[1 << NUMBER_PEEK];
+};
+
+void carps_decoder_init(struct carps_decoder *d, FILE *log, bool trace);
+void carps_decoder_free(struct carps_decoder *d);
+/* set line length from strip header, returns -1 on error */
+int carps_decoder_line_len(struct carps_decoder *d, u16 line_len);
+/* start print data of a strip */
+void carps_decoder_strip(struct carps_decoder *d);
+/*
+ * Add strip data (without print data header), last if there are no more. Data must be valid
+ * until carps_decoder_pull_line() returns NULL.
+ */
+void carps_decoder_push(struct carps_decoder *d, const u8 *data, u32 len, long pos, bool last);
+/* next decoded line (line_len bytes), NULL if more data are needed or strip is done */
+const u8 *carps_decoder_pull_line(struct carps_decoder *d);
+/* end of page: incomplete line is returned in partial, returns number of complete lines */
+int carps_decoder_page_end(struct carps_decoder *d, const u8 **partial, u16 *len);
+
+
+/*
+ * G4 decoder: carps_g4_decode() decodes the data of a whole strip into num_lines lines of
+ * CARPS_LINE_LEN(width) bytes (bits past width are zero) and returns the number of lines
+ * decoded, fewer if the data end early or are invalid, -1 if memory could not be allocated.
+ */
+#define G4_PEEK	13	/* longest run code */
+struct g4_run_entry {
+	u16 run;
+	u8 bits;	/* 0 = invalid code */
+};
+
+struct carps_g4_decoder {
+	/* lookup tables for first G4_PEEK bits of a run code */
+	struct g4_run_entry white_table[1 << G4_PEEK], black_table[1 << G4_PEEK];
+	int *ref, *cur;	/* changing elements of reference and coding line, ended by width */
+	int width;	/* allocated for */
+};
+
+void carps_g4_decoder_init(struct carps_g4_decoder *d);
+void carps_g4_decoder_free(struct carps_g4_decoder *d);
+int carps_g4_decode(struct carps_g4_decoder *d, const u8 *data, u32 len, int width, int num_lines, u8 *lines);
+
+#endif
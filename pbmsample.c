@@ -0,0 +1,152 @@
+/* CUPS driver for Canon CARPS printers - derives benchmark samples from other PBM samples */
+/* Copyright (c) 2014 Ondrej Zary */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * half: 300 dpi version of a 600 dpi page, each pixel is black if any of its 2x2 pixels is,
+ * so thin lines and small text are kept.
+ * <width> <height>: the page on another paper size, cropped or padded with white on the
+ * right, extra lines repeat the page from the top so the content stays the same kind.
+ * random <seed> <width> <height>: sparse random page (half of the bytes are zero, the others
+ * have the high bit set), the same for the same seed.
+ */
+
+#define PIXEL(line, x)	(((line)[(x) >> 3] >> (7 - ((x) & 7))) & 1)
+
+/* xorshift64, the same sequence everywhere */
+static uint64_t random_next(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+
+	return *state;
+}
+
+static int random_page(unsigned long seed, int width, int height, const char *name) {
+	uint64_t state = seed * 0x9e3779b97f4a7c15ULL + 1;	/* never 0 */
+	int line_len = (width + 7) / 8;
+	FILE *out;
+
+	if (width <= 0 || height <= 0) {
+		fprintf(stderr, "Invalid output size %dx%d\n", width, height);
+		return 1;
+	}
+	out = fopen(name, "w");
+	if (!out) {
+		perror("Unable to create output file");
+		return 2;
+	}
+	fprintf(out, "P4\n%d %d\n", width, height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < line_len; x++) {
+			unsigned char byte = random_next(&state) >> 56;
+			if (byte < 0x80)
+				byte = 0;
+			if (x == line_len - 1 && width % 8)
+				byte &= 0xff << (8 - width % 8);
+			fputc(byte, out);
+		}
+	if (fclose(out)) {
+		perror("Unable to write output file");
+		return 2;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char tmp[100];
+	int width, height, out_width, out_height;
+	unsigned char *page, *line;
+	FILE *f, *out;
+
+	if (argc == 6 && !strcmp(argv[1], "random"))
+		return random_page(strtoul(argv[2], NULL, 0), atoi(argv[3]), atoi(argv[4]), argv[5]);
+	if (argc != 4 && argc != 5) {
+		fprintf(stderr, "usage: pbmsample <file.pbm> half <out.pbm>\n");
+		fprintf(stderr, "       pbmsample <file.pbm> <width> <height> <out.pbm>\n");
+		fprintf(stderr, "       pbmsample random <seed> <width> <height> <out.pbm>\n");
+		return 1;
+	}
+	f = fopen(argv[1], "r");
+	if (!f) {
+		perror("Unable to open file");
+		return 2;
+	}
+	if (!fgets(tmp, sizeof(tmp), f) || strcmp(tmp, "P4\n")) {
+		fprintf(stderr, "Invalid PBM file\n");
+		return 2;
+	}
+	do
+		if (!fgets(tmp, sizeof(tmp), f)) {
+			fprintf(stderr, "Invalid PBM file\n");
+			return 2;
+		}
+	while (tmp[0] == '#');
+	if (sscanf(tmp, "%d %d", &width, &height) != 2 || width <= 0 || height <= 0) {
+		fprintf(stderr, "Invalid PBM file\n");
+		return 2;
+	}
+	if (argc == 4) {
+		if (strcmp(argv[2], "half")) {
+			fprintf(stderr, "Unknown conversion %s\n", argv[2]);
+			return 1;
+		}
+		out_width = width / 2;
+		out_height = height / 2;
+	} else {
+		out_width = atoi(argv[2]);
+		out_height = atoi(argv[3]);
+	}
+	if (out_width <= 0 || out_height <= 0) {
+		fprintf(stderr, "Invalid output size %dx%d\n", out_width, out_height);
+		return 1;
+	}
+
+	int line_len = (width + 7) / 8, out_line_len = (out_width + 7) / 8;
+	page = calloc(height, line_len);
+	line = malloc(out_line_len);
+	if (!page || !line) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 2;
+	}
+	/* partial page at the end stays white */
+	if (fread(page, line_len, height, f) != (size_t)height)
+		fprintf(stderr, "%s: file is truncated\n", argv[1]);
+	fclose(f);
+
+	out = fopen(argv[argc - 1], "w");
+	if (!out) {
+		perror("Unable to create output file");
+		return 2;
+	}
+	fprintf(out, "P4\n%d %d\n", out_width, out_height);
+	for (int y = 0; y < out_height; y++) {
+		memset(line, 0, out_line_len);
+		if (argc == 4) {
+			unsigned char *a = page + (size_t)2 * y * line_len, *b = a + line_len;
+			for (int x = 0; x < out_width; x++)
+				if (PIXEL(a, 2 * x) | PIXEL(a, 2 * x + 1) | PIXEL(b, 2 * x) | PIXEL(b, 2 * x + 1))
+					line[x >> 3] |= 0x80 >> (x & 7);
+		} else {
+			memcpy(line, page + (size_t)(y % height) * line_len, (out_line_len < line_len) ? out_line_len : line_len);
+			/* clear bits past the narrower width */
+			if (out_width > width && width % 8)
+				line[width / 8] &= 0xff << (8 - width % 8);
+			if (out_width % 8)
+				line[out_line_len - 1] &= 0xff << (8 - out_width % 8);
+		}
+		fwrite(line, 1, out_line_len, out);
+	}
+	free(line);
+	free(page);
+	if (fclose(out)) {
+		perror("Unable to write output file");
+		return 2;
+	}
+
+	return 0;
+}
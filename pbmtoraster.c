@@ -0,0 +1,91 @@
+/* CUPS driver for Canon CARPS printers - PBM to CUPS raster converter for benchmarks */
+/* Copyright (c) 2014 Ondrej Zary */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cups/raster.h>
+
+#define POINTS_PER_INCH 72
+
+int main(int argc, char *argv[]) {
+	cups_page_header2_t header;
+	cups_raster_t *ras;
+	char tmp[100];
+	int width, height, dpi;
+	FILE *f;
+
+	if (argc != 5) {
+		fprintf(stderr, "usage: pbmtoraster <file.pbm> <dpi> <A4|Legal|...> <file.ras>\n");
+		return 1;
+	}
+	f = fopen(argv[1], "r");
+	if (!f) {
+		perror("Unable to open file");
+		return 2;
+	}
+	if (!fgets(tmp, sizeof(tmp), f) || strcmp(tmp, "P4\n")) {
+		fprintf(stderr, "Invalid PBM file\n");
+		return 2;
+	}
+	do
+		if (!fgets(tmp, sizeof(tmp), f)) {
+			fprintf(stderr, "Invalid PBM file\n");
+			return 2;
+		}
+	while (tmp[0] == '#');
+	if (sscanf(tmp, "%d %d", &width, &height) != 2) {
+		fprintf(stderr, "Invalid PBM file\n");
+		return 2;
+	}
+	dpi = atoi(argv[2]);
+
+	int fd = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("Unable to create raster file");
+		return 2;
+	}
+	ras = cupsRasterOpen(fd, CUPS_RASTER_WRITE);
+	if (!ras) {
+		fprintf(stderr, "Unable to create raster stream\n");
+		return 2;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.HWResolution[0] = header.HWResolution[1] = dpi;
+	header.PageSize[0] = width * POINTS_PER_INCH / dpi;
+	header.PageSize[1] = height * POINTS_PER_INCH / dpi;
+	header.NumCopies = 1;
+	header.cupsWidth = width;
+	header.cupsHeight = height;
+	header.cupsMediaType = 20;	/* plain paper */
+	header.cupsBitsPerColor = 1;
+	header.cupsBitsPerPixel = 1;
+	header.cupsBytesPerLine = (width + 7) / 8;
+	header.cupsColorOrder = CUPS_ORDER_CHUNKED;
+	header.cupsColorSpace = CUPS_CSPACE_K;
+	header.cupsNumColors = 1;
+	strncpy(header.cupsPageSizeName, argv[3], sizeof(header.cupsPageSizeName) - 1);
+	if (!cupsRasterWriteHeader2(ras, &header)) {
+		fprintf(stderr, "Unable to write raster header\n");
+		return 2;
+	}
+
+	unsigned char *line = malloc(header.cupsBytesPerLine);
+	if (!line) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 2;
+	}
+	for (int i = 0; i < height; i++) {
+		if (fread(line, 1, header.cupsBytesPerLine, f) != header.cupsBytesPerLine)
+			memset(line, 0, header.cupsBytesPerLine);
+		cupsRasterWritePixels(ras, line, header.cupsBytesPerLine);
+	}
+	free(line);
+	cupsRasterClose(ras);
+	close(fd);
+	fclose(f);
+
+	return 0;
+}
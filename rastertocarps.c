@@ -1,5 +1,6 @@
 /* CUPS driver for Canon CARPS printers */
 /* Copyright (c) 2014 Ondrej Zary */
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,17 +9,25 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <cups/ppd.h>
 #include <cups/raster.h>
-#include "carps.h"
-#include "tiffio.h"
+#include "libcarps.h"
+#include "carps-util.h"
 
 //#define DEBUG
 //#define PBM
 
 #define ERR(fmt, args ...)	fprintf(stderr, "ERROR: CARPS " fmt "\n", ##args);
 #define WARN(fmt, args ...)	fprintf(stderr, "WARNING: CARPS " fmt "\n", ##args);
+#define LOG(fmt, args ...)	fprintf(stderr, "DEBUG: CARPS " fmt "\n", ##args);
+#define INFO(fmt, args ...)	fprintf(stderr, "INFO: CARPS " fmt "\n", ##args);
 
 #ifdef DEBUG
 //#define DBG(fmt, args ...)	fprintf(stderr, "DEBUG: CARPS " fmt "\n", ##args);
@@ -27,688 +36,1323 @@
 #define DBG(fmt, args ...)	do {} while (0)
 #endif
 
-int global_line_num, global_outpos;
+/*
+ * Output: blocks are collected in batches as lists of iovecs pointing to block headers (built
+ * in place in the batch) and to print data (not copied, the batch frees it after writing).
+ * Batches are written using writev(), either directly or by the writer thread. Print data is
+ * packed into full MAX_BLOCK_LEN blocks.
+ */
+struct out_batch {
+	struct out_batch *next;
+	int fd;
+	struct iovec *iov;
+	int iovcnt;
+	u8 *head;		/* block headers and copied data */
+	unsigned int head_len;
+	void *data;		/* print data, freed after writing */
+	unsigned int len;	/* total bytes */
+	unsigned int blocks, copied;	/* copied = bytes copied to head except block headers */
+	int end_page;		/* page ended by this batch, 0 = none */
+};
 
-void fill_header(struct carps_header *header, u8 data_type, u8 block_type, u16 data_len) {
-	memset(header, 0, sizeof(struct carps_header));
-	header->magic1 = 0xCD;
-	header->magic2 = 0xCA;
-	header->magic3 = 0x10;
-	header->data_type = data_type;
-	header->block_type = block_type;
-	header->one = 0x01;
-	header->data_len = cpu_to_be16(data_len);
-}
+struct out_batch *batch_alloc(int fd, unsigned int blocks, unsigned int head_size) {
+	struct out_batch *b = malloc(sizeof(struct out_batch) + 2 * blocks * sizeof(struct iovec) + head_size);
 
-void write_block(u8 data_type, u8 block_type, void *data, u16 data_len, FILE *stream) {
-	struct carps_header header;
+	if (!b) {
+		fprintf(stderr, "Memory allocation error\n");
+		exit(2);
+	}
+	memset(b, 0, sizeof(struct out_batch));
+	b->fd = fd;
+	b->iov = (void *)(b + 1);
+	b->head = (void *)(b->iov + 2 * blocks);
 
-	fill_header(&header, data_type, block_type, data_len);
-	fwrite(&header, 1, sizeof(header), stream);
-	fwrite(data, 1, data_len, stream);
-	global_outpos += sizeof(header) + data_len;
+	return b;
 }
 
-/* put n bits of data */
-void put_bits(char **data, u16 *len, u8 *bitpos, u8 n, u8 bits) {
-	if (!data)
+/* add data to batch, merging with previous iovec if contiguous */
+void batch_add(struct out_batch *b, const void *data, unsigned int len) {
+	struct iovec *prev = b->iovcnt ? &b->iov[b->iovcnt - 1] : NULL;
+
+	if (!len)
 		return;
-	DBG("put_bits len=%d, pos=%d, n=%d, bits=%s\n", *len, *bitpos, n, bin_n(bits, n));
-	bits <<= 8 - n;
-	for (int i = 0; i < n; i++) {
-		/* clear the byte first */
-		if (*bitpos == 0)
-			*data[0] = 0;
-		if (bits & 0x80)
-			*data[0] |= 1 << (7 - *bitpos);
-		bits <<= 1;
-		(*bitpos)++;
-		if (*bitpos > 7) {
-			*data[0] ^= PRINT_DATA_XOR;
-			(*data)++;
-			(*len)++;
-			*bitpos = 0;
-		}
-	}
+	b->len += len;
+	if (prev && (u8 *)prev->iov_base + prev->iov_len == data)
+		prev->iov_len += len;
+	else
+		b->iov[b->iovcnt++] = (struct iovec) { .iov_base = (void *)data, .iov_len = len };
 }
 
-u16 line_len, line_len_file, line_pos;
-int width, height, dpi;
-u8 *last_lines[8], *cur_line;
+/* build block header in batch head, followed by len bytes of data copied from p */
+u8 *batch_block(struct out_batch *b, u8 data_type, u8 block_type, u16 data_len, const void *p, unsigned int len) {
+	u8 *pos = b->head + b->head_len;
 
-int count_run_length(int line_pos, int line_num, __attribute__((unused)) int param) {
-	int i;
-	u8 first;
+	carps_fill_header((void *)pos, data_type, block_type, data_len);
+	if (len)
+		memcpy(pos + sizeof(struct carps_header), p, len);
+	b->head_len += sizeof(struct carps_header) + len;
+	b->copied += len;
+	b->blocks++;
+	batch_add(b, pos, sizeof(struct carps_header) + len);
 
-	if (line_num == 0 && line_pos == 0)	/* prevent -1 on first line */
-		return 0;
+	return pos;
+}
 
-	line_pos -= 1;
+struct out_stats {
+	unsigned int blocks, bytes, syscalls, copied;
+};
 
-	if (line_pos < 0)	/* will work only for -1 */
-		first = last_lines[0][line_len - 1];
-	else
-		first = cur_line[line_pos];
+/*
+ * Writer stage: when running, batches are queued and written by a separate thread so that a
+ * slow backend does not stop reading and encoding until the queue is full. All batches queued
+ * while writing are then written together.
+ */
+#define WRITE_QUEUE_BLOCKS	64
+
+struct write_queue {
+	pthread_t thread;
+	bool running;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full;
+	struct out_batch *head, **tail;
+	unsigned int blocks;	/* queued or being written */
+	bool quit;
+	struct out_batch *pending, **pending_tail;	/* not running: batches not written yet */
+	unsigned int pending_blocks;
+	u64 write_ns, idle_ns;	/* writer thread: writing, waiting for blocks */
+	u64 full_ns;		/* waiting for space in queue */
+};
 
-	for (i = line_pos + 1; i < line_len; i++)
-		if (cur_line[i] != first)
-			break;
+/* current page: timing and output counted by output_batch() */
+struct page_stats {
+	u64 start;	/* page start */
+	u64 first_data;	/* first print data output, 0 = none yet */
+	unsigned int strips, blocks;
+	u64 bytes;	/* CARPS data output */
+};
 
-	return i - line_pos - 1;
+/* job output, batches are output by one thread only */
+struct output {
+	int fd;
+	struct write_queue writer;
+	struct out_stats stats;	/* written since the last page end */
+	bool error;	/* a write failed, nothing more is written */
+	u64 bytes;	/* all batches output */
+	struct page_stats page;
+};
+
+void output_init(struct output *out, int fd) {
+	memset(out, 0, sizeof(*out));
+	out->fd = fd;
+	out->writer.tail = &out->writer.head;
+	out->writer.pending_tail = &out->writer.pending;
 }
 
-int count_prev(int line_pos, int line_num, int num_last) {
-	int i;
-	if (line_num <= num_last)
-		return 0;
+/*
+ * write list of batches using as few writev() calls as possible, then free them
+ * a call never continues past the end of a page, so the statistics are split there
+ */
+void write_batches(struct output *out, struct out_batch *list) {
+	struct iovec iov[IOV_MAX];
+	struct out_batch *b = list;
+	int i = 0, n;
+
+	while (b) {
+		struct out_batch *first = b;
+		int fd = b->fd, end_page = 0;
+		/* gather iovecs of following batches for the same fd */
+		for (n = 0; b && b->fd == fd && n < IOV_MAX && !end_page; ) {
+			if (i < b->iovcnt)
+				iov[n++] = b->iov[i++];
+			if (i == b->iovcnt) {
+				i = 0;
+				end_page = b->end_page;
+				b = b->next;
+			}
+		}
+		struct iovec *pos = iov;
+		while (n > 0 && !out->error) {
+			ssize_t ret = writev(fd, pos, n);
+			out->stats.syscalls++;
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				ERR("Unable to write output: %s", strerror(errno));
+				out->error = true;
+				break;
+			}
+			out->stats.bytes += ret;
+			/* skip written data, partial write is possible */
+			while (n > 0 && (size_t)ret >= pos->iov_len) {
+				ret -= pos->iov_len;
+				pos++;
+				n--;
+			}
+			if (n > 0) {
+				pos->iov_base = (u8 *)pos->iov_base + ret;
+				pos->iov_len -= ret;
+			}
+		}
+		/* batches written completely (one split by IOV_MAX is counted with its last part) */
+		for (struct out_batch *d = first; d != b; d = d->next) {
+			out->stats.blocks += d->blocks;
+			out->stats.copied += d->copied;
+		}
+		if (end_page) {
+			LOG("page %d: %u blocks, %u bytes, %u write calls, %u bytes copied",
+			    end_page, out->stats.blocks, out->stats.bytes, out->stats.syscalls, out->stats.copied);
+			out->stats = (struct out_stats) { 0 };
+		}
+	}
+	while (list) {
+		b = list;
+		list = list->next;
+		free(b->data);
+		free(b);
+	}
+}
 
-	for (i = line_pos; i < line_len; i++)
-		if (cur_line[i] != last_lines[num_last][i])
+void *writer_thread(void *arg) {
+	struct output *out = arg;
+	struct write_queue *w = &out->writer;
+	struct out_batch *list;
+	unsigned int blocks;
+	u64 t;
+
+	pthread_mutex_lock(&w->lock);
+	while (true) {
+		if (!w->head && !w->quit) {
+			t = time_ns();
+			while (!w->head && !w->quit)
+				pthread_cond_wait(&w->not_empty, &w->lock);
+			w->idle_ns += time_ns() - t;
+		}
+		if (!w->head)	/* quit and nothing left */
 			break;
+		/* take all queued batches */
+		list = w->head;
+		w->head = NULL;
+		w->tail = &w->head;
+		blocks = 0;
+		for (struct out_batch *b = list; b; b = b->next)
+			blocks += b->blocks;
+		pthread_mutex_unlock(&w->lock);
+		t = time_ns();
+		write_batches(out, list);
+		w->write_ns += time_ns() - t;
+		pthread_mutex_lock(&w->lock);
+		w->blocks -= blocks;
+		pthread_cond_signal(&w->not_full);
+	}
+	pthread_mutex_unlock(&w->lock);
 
-	return i - line_pos;
+	return NULL;
 }
 
-int count_this(int line_pos, __attribute__((unused)) int line_num, int offset) {
-	int i;
-	int max = 0;
-	if (line_pos < -offset)
-		return 0;
-	if (offset == -80)	/* does not use prefix: 127 is max */
-		max = 127;
+/* write all batches not written yet */
+void output_flush(struct output *out) {
+	struct write_queue *w = &out->writer;
 
-	for (i = line_pos; i < line_len; i++)
-		if (cur_line[i] != cur_line[i + offset])
-			break;
+	if (w->pending)
+		write_batches(out, w->pending);
+	w->pending = NULL;
+	w->pending_tail = &w->pending;
+	w->pending_blocks = 0;
+}
 
-	if (max && i - line_pos > max)
-		return max;
+/* queue batch for writer thread or write it */
+void output_batch(struct output *out, struct out_batch *b) {
+	struct write_queue *w = &out->writer;
+	u64 t;
+
+	out->bytes += b->len;
+	out->page.blocks += b->blocks;
+	out->page.bytes += b->len;
+	if (b->data && !out->page.first_data)
+		out->page.first_data = time_ns();
+	b->next = NULL;
+	if (!w->running) {
+		/* collect small blocks and write them together with the next print data */
+		*w->pending_tail = b;
+		w->pending_tail = &b->next;
+		w->pending_blocks += b->blocks;
+		if (b->data || b->end_page || w->pending_blocks >= WRITE_QUEUE_BLOCKS)
+			output_flush(out);
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	if (w->blocks && w->blocks + b->blocks > WRITE_QUEUE_BLOCKS) {
+		t = time_ns();
+		while (w->blocks && w->blocks + b->blocks > WRITE_QUEUE_BLOCKS)
+			pthread_cond_wait(&w->not_full, &w->lock);
+		w->full_ns += time_ns() - t;
+	}
+	*w->tail = b;
+	w->tail = &b->next;
+	w->blocks += b->blocks;
+	pthread_cond_signal(&w->not_empty);
+	pthread_mutex_unlock(&w->lock);
+}
+
+int writer_start(struct output *out) {
+	struct write_queue *w = &out->writer;
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->not_empty, NULL);
+	pthread_cond_init(&w->not_full, NULL);
+	if (pthread_create(&w->thread, NULL, writer_thread, out))
+		return -1;
+	w->running = true;
 
-	return i - line_pos;
+	return 0;
 }
 
-int dict_search(u8 byte, u8 *dict) {
-	for (int i = 0; i < DICT_SIZE; i++)
-		if (dict[i] == byte)
-			return i;
+/* write all queued batches and stop the thread */
+void writer_stop(struct output *out) {
+	struct write_queue *w = &out->writer;
 
-	return -1;
+	pthread_mutex_lock(&w->lock);
+	w->quit = true;
+	pthread_cond_signal(&w->not_empty);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	w->running = false;
 }
 
-void dict_add(u8 byte, u8 *dict) {
-//	DBG("DICTIONARY=");
-//	for (int i = 0; i < DICT_SIZE; i++)
-//		DBG("%02X ", dict[i]);
-//	DBG("\n");
+void write_block(struct output *out, u8 data_type, u8 block_type, const void *data, u16 data_len) {
+	struct out_batch *b = batch_alloc(out->fd, 1, sizeof(struct carps_header) + data_len);
 
-	for (int i = 0; i < DICT_SIZE; i++)
-		if (dict[i] == byte) {
-			memmove(dict + i, dict + i + 1, DICT_SIZE - i);
-			break;
-		}
-	memmove(dict + 1, dict, DICT_SIZE - 1);
-	dict[0] = byte;
+	batch_block(b, data_type, block_type, data_len, data, data_len);
+	output_batch(out, b);
+}
+
+void write_page_end(struct output *out, int page) {
+	u8 page_end[] = { 0x01, 0x0c };
+	struct out_batch *b = batch_alloc(out->fd, 1, sizeof(struct carps_header) + sizeof(page_end));
+
+	batch_block(b, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, sizeof(page_end), page_end, sizeof(page_end));
+	b->end_page = page;
+	output_batch(out, b);
 }
 
-int fls(unsigned int n) {
-	int i = 0;
+/*
+ * Headers (starting with 0x01 byte) followed by print data in print blocks. Each continuing
+ * block starts with 0x01 byte. Data is freed after writing. Can be called from any thread.
+ */
+struct out_batch *print_data_batch(const u8 *headers, unsigned int headers_len, u8 *data, u32 len, int fd) {
+	unsigned int blocks = carps_print_blocks_count(headers_len, len), chunk;
+	struct out_batch *b;
+
+	b = batch_alloc(fd, blocks, blocks * (sizeof(struct carps_header) + 1) + headers_len);
+	b->data = data;
+	/* first block: headers and as much data as fits */
+	chunk = (headers_len + len > MAX_DATA_LEN) ? MAX_DATA_LEN - headers_len : len;
+	batch_block(b, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, headers_len + chunk, headers, headers_len);
+	batch_add(b, data, chunk);
+	for (u32 pos = chunk; pos < len; pos += chunk) {
+		chunk = (len - pos > MAX_DATA_LEN - 1) ? MAX_DATA_LEN - 1 : len - pos;
+		batch_block(b, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, 1 + chunk, "\x01", 1);
+		batch_add(b, data + pos, chunk);
+	}
 
-	while (n >>= 1)
-		i++;
+	return b;
+}
 
-	return i;
+void write_print_data(struct output *out, const u8 *headers, unsigned int headers_len, u8 *data, u32 len) {
+	output_batch(out, print_data_batch(headers, headers_len, data, len, out->fd));
 }
 
-int encode_number(char **data, u16 *len, u8 *bitpos, int num) {
-	int num_bits;
-	int bits = 0;
-	DBG("encode_number(%d)\n", num);
+/*
+ * CUPS raster file mapped into memory: page headers are parsed here, lines of compressed
+ * (version 2) raster are decoded from the mapping, so nothing is read through a buffer.
+ * Unpadded uncompressed lines are encoded in place (raster_map_lines() for the encoder pool,
+ * raster_map_line_at() for the stream), others are copied.
+ */
+#define RASTER_SYNC		0x52615374	/* "RaSt", version 1 */
+#define RASTER_SYNC_V2		0x52615332	/* "RaS2", compressed */
+#define RASTER_SYNC_V3		0x52615333	/* "RaS3" */
+#define RASTER_SWAPPED_WORDS	81	/* unsigned and float fields of page header from AdvanceDistance */
+
+struct raster_map {
+	const u8 *data;
+	size_t size, pos;
+	bool swapped;		/* written in the other byte order */
+	bool compressed;
+	unsigned int bpp;	/* bytes per pixel */
+	unsigned int line_len;	/* bytes per line */
+	unsigned int lines;	/* lines left in current page */
+	unsigned int repeat;	/* compressed: the last line is repeated this many times */
+	u8 *line;		/* compressed: the last line */
+};
 
-	if (num == 0) {
-		put_bits(data, len, bitpos, 6, 0b111111);
-		return 6;
+/* map raster file, false if it is not a regular file with a known sync word */
+bool raster_map_open(struct raster_map *m, int fd) {
+	struct stat st;
+	u32 sync;
+
+	memset(m, 0, sizeof(*m));
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < 4)
+		return false;
+	m->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m->data == MAP_FAILED) {
+		m->data = NULL;
+		return false;
+	}
+	m->size = st.st_size;
+	madvise((void *)m->data, m->size, MADV_SEQUENTIAL);
+	memcpy(&sync, m->data, 4);
+	m->swapped = (sync != RASTER_SYNC && sync != RASTER_SYNC_V2 && sync != RASTER_SYNC_V3);
+	if (m->swapped)
+		sync = __builtin_bswap32(sync);
+	if (sync != RASTER_SYNC && sync != RASTER_SYNC_V2 && sync != RASTER_SYNC_V3) {
+		munmap((void *)m->data, m->size);
+		m->data = NULL;
+		return false;
 	}
+	m->compressed = (sync == RASTER_SYNC_V2);
+	m->pos = 4;
 
-	if (num == 1) {
-		put_bits(data, len, bitpos, 2, 0b00);
-		return 2;
+	return true;
+}
+
+void raster_map_close(struct raster_map *m) {
+	if (m->data)
+		munmap((void *)m->data, m->size);
+	free(m->line);
+}
+
+/* decode one compressed line into line, false if the file is truncated */
+bool raster_map_decode(struct raster_map *m, u8 *line) {
+	unsigned int len = 0;
+
+	if (m->pos >= m->size)
+		return false;
+	m->repeat = m->data[m->pos++];
+	while (len < m->line_len) {
+		if (m->pos >= m->size)
+			return false;
+		unsigned int count = m->data[m->pos++];
+		if (count == 128) {
+			/* clear to end of line */
+			memset(line + len, 0, m->line_len - len);
+			len = m->line_len;
+		} else if (count > 128) {
+			/* literal pixels */
+			count = MIN((257 - count) * m->bpp, m->line_len - len);
+			if (m->size - m->pos < count)
+				return false;
+			memcpy(line + len, m->data + m->pos, count);
+			m->pos += count;
+			len += count;
+		} else {
+			/* one pixel repeated */
+			count = MIN((count + 1) * m->bpp, m->line_len - len);
+			if (m->size - m->pos < m->bpp)
+				return false;
+			if (m->bpp == 1)
+				memset(line + len, m->data[m->pos], count);
+			else
+				for (unsigned int i = 0; i < count; i++)
+					line[len + i] = m->data[m->pos + i % m->bpp];
+			m->pos += m->bpp;
+			len += count;
+		}
 	}
+	if (m->repeat && line != m->line)
+		memcpy(m->line, line, m->line_len);
+
+	return true;
+}
 
-	num_bits = fls(num);
-	DBG("num_bits=%d\n", num_bits);
-	if (num_bits == 1) {
-		put_bits(data, len, bitpos, 2, 0b01);
-		bits += 2;
+/* next line of current page (bytes per line of the file), false if there is none */
+bool raster_map_line(struct raster_map *m, u8 *line) {
+	if (!m->lines)
+		return false;
+	if (m->compressed) {
+		if (m->repeat) {
+			memcpy(line, m->line, m->line_len);
+			m->repeat--;
+		} else if (!raster_map_decode(m, line)) {
+			m->lines = 0;
+			return false;
+		}
 	} else {
-		put_bits(data, len, bitpos, num_bits - 1, 0xff);
-		put_bits(data, len, bitpos, 1, 0b0);
-		bits += num_bits;
+		if (m->size - m->pos < m->line_len) {
+			m->lines = 0;
+			return false;
+		}
+		memcpy(line, m->data + m->pos, m->line_len);
+		m->pos += m->line_len;
 	}
-	put_bits(data, len, bitpos, num_bits, ~num & MASK(num_bits));
-	bits += num_bits;
+	m->lines--;
+
+	return true;
+}
+
+/* next line in place if HISTORY_PAD bytes after it are mapped too, NULL if it has to be copied */
+const u8 *raster_map_line_at(struct raster_map *m, unsigned int line_len) {
+	const u8 *line = m->data + m->pos;
+
+	if (m->compressed || m->line_len != line_len || !m->lines || m->size - m->pos < line_len + HISTORY_PAD)
+		return NULL;
+	m->pos += line_len;
+	m->lines--;
+
+	return line;
+}
 
-	return bits;
+/*
+ * Up to num_lines lines of current page in place, stored in lines, NULL if they are not
+ * usable as they are (compressed or padded to line_len).
+ */
+const u8 *raster_map_lines(struct raster_map *m, unsigned int line_len, int num_lines, int *lines) {
+	const u8 *p = m->data + m->pos;
+	unsigned int n = MIN((unsigned int)num_lines, m->lines);
+
+	if (m->compressed || m->line_len != line_len)
+		return NULL;
+	/* truncated file ends the page */
+	if ((m->size - m->pos) / line_len < n)
+		n = m->lines = (m->size - m->pos) / line_len;
+	m->pos += (size_t)n * line_len;
+	m->lines -= n;
+	*lines = n;
+
+	return p;
 }
 
-int encode_prefix(char **data, u16 *len, u8 *bitpos, int num) {
-	put_bits(data, len, bitpos, 8, 0b11111100);
+/* skip the rest of current page and read next page header, 0 if there is none */
+unsigned int raster_map_header(struct raster_map *m, cups_page_header2_t *header) {
+	while (m->compressed && m->lines && raster_map_line(m, m->line))
+		;
+	if (!m->compressed)
+		m->pos += MIN((size_t)m->lines * m->line_len, m->size - m->pos);
+	m->lines = 0;
+	m->repeat = 0;
+	if (m->size - m->pos < sizeof(*header))
+		return 0;
+	memcpy(header, m->data + m->pos, sizeof(*header));
+	m->pos += sizeof(*header);
+	if (m->swapped) {
+		u32 *word = (u32 *)&header->AdvanceDistance;
+		for (int i = 0; i < RASTER_SWAPPED_WORDS; i++)
+			word[i] = __builtin_bswap32(word[i]);
+	}
+	/* the same checks as cupsRasterReadHeader2() */
+	m->bpp = (header->cupsBitsPerPixel + 7) / 8;
+	if (header->cupsBitsPerPixel > 240 || header->cupsBitsPerColor > 16 || header->cupsBytesPerLine == 0 ||
+	    header->cupsHeight == 0 || header->cupsBytesPerLine % m->bpp ||
+	    header->cupsBytesPerLine != (header->cupsWidth * header->cupsBitsPerPixel + 7) / 8)
+		return 0;
+	if (m->compressed && header->cupsBytesPerLine > m->line_len) {
+		free(m->line);
+		m->line = malloc(header->cupsBytesPerLine);
+		if (!m->line)
+			return 0;
+	}
+	m->line_len = header->cupsBytesPerLine;
+	m->lines = header->cupsHeight;
 
-	return 8 + encode_number(data, len, bitpos, num / 128);
+	return 1;
 }
 
-int encode_last(char **data, u16 *len, u8 *bitpos, int count, __attribute__((unused)) bool *prev8_flag, bool *twobyte_flag, int num_last) {
-	int bits = 0;
-	bool twobyte_flag_change = (num_last == -1) ? *twobyte_flag : !*twobyte_flag;
+/*
+ * Reader stage: a separate thread reads raster lines of the current page into a bounded
+ * queue, so waiting for the upstream filter overlaps with encoding.
+ */
+#define READ_QUEUE_LINES	256
 
-	if (data) /* change flag only if this encoding is really used */
-		*twobyte_flag = (num_last == -2);
+struct read_queue;
 
-	if (count >= 128)
-		bits += encode_prefix(data, len, bitpos, count);
-	count %= 128;
-	if (twobyte_flag_change) {
-		put_bits(data, len, bitpos, 2, 0b11);
-		bits += 2;
-		bits += 6;////penalty
+/* raster lines come from PBM file, CUPS raster stream or file, a buffered page or the reader */
+struct raster_source {
+	FILE *f;
+	cups_raster_t *ras;
+	struct raster_map *map;
+	const u8 *page;		/* line_len bytes per line */
+	int page_lines;		/* lines left in page */
+	const u8 *page_end;	/* end of readable memory after page */
+	struct read_queue *queue;	/* lines come from reader thread */
+	u16 line_len;		/* lines are padded with zeros to line_len */
+	u16 line_len_file;
+};
+
+struct read_queue {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty, not_full, request;
+	struct raster_source *src;	/* where the lines are read from */
+	u8 *lines;			/* READ_QUEUE_LINES lines */
+	u16 line_len;
+	int head, count;
+	int requested;	/* lines still to read from current page */
+	bool end;	/* no more lines in current page */
+	bool quit;
+	u64 read_ns, full_ns;	/* reader thread: reading, waiting for space in queue */
+	u64 empty_ns;		/* waiting for lines */
+};
+
+bool read_line(struct raster_source *src, u8 *line);
+
+void *reader_thread(void *arg) {
+	struct read_queue *rq = arg;
+	u64 t;
+
+	pthread_mutex_lock(&rq->lock);
+	while (true) {
+		while (!rq->quit && !rq->requested)
+			pthread_cond_wait(&rq->request, &rq->lock);
+		if (rq->count == READ_QUEUE_LINES && !rq->quit) {
+			t = time_ns();
+			while (rq->count == READ_QUEUE_LINES && !rq->quit)
+				pthread_cond_wait(&rq->not_full, &rq->lock);
+			rq->full_ns += time_ns() - t;
+		}
+		if (rq->quit)
+			break;
+		int slot = (rq->head + rq->count) % READ_QUEUE_LINES;
+		pthread_mutex_unlock(&rq->lock);
+		t = time_ns();
+		bool ok = read_line(rq->src, rq->lines + slot * rq->line_len);
+		rq->read_ns += time_ns() - t;
+		pthread_mutex_lock(&rq->lock);
+		if (ok) {
+			rq->count++;
+			rq->requested--;
+		}
+		if (!ok || !rq->requested) {
+			rq->requested = 0;
+			rq->end = true;
+		}
+		pthread_cond_signal(&rq->not_empty);
 	}
-	put_bits(data, len, bitpos, 4, 0b1110);
-	bits += 4;
+	pthread_mutex_unlock(&rq->lock);
 
-	return bits + encode_number(data, len, bitpos, count);
+	return NULL;
 }
 
-int encode_prev(char **data, u16 *len, u8 *bitpos, int count, bool *prev8_flag, __attribute__((unused)) bool *twobyte_flag, int num_last) {
-	int bits = 0;
-	bool prev8_flag_change = (num_last == 3) ? *prev8_flag : !*prev8_flag;
+int reader_start(struct read_queue *rq, struct raster_source *src) {
+	memset(rq, 0, sizeof(*rq));
+	pthread_mutex_init(&rq->lock, NULL);
+	pthread_cond_init(&rq->not_empty, NULL);
+	pthread_cond_init(&rq->not_full, NULL);
+	pthread_cond_init(&rq->request, NULL);
+	rq->end = true;
+	rq->src = src;
+	if (pthread_create(&rq->thread, NULL, reader_thread, rq))
+		return -1;
 
-	if (data) /* change flag only if this encoding is really used */
-		*prev8_flag = (num_last == 7);
+	return 0;
+}
+
+void reader_stop(struct read_queue *rq) {
+	pthread_mutex_lock(&rq->lock);
+	rq->quit = true;
+	pthread_cond_signal(&rq->request);
+	pthread_cond_signal(&rq->not_full);
+	pthread_mutex_unlock(&rq->lock);
+	pthread_join(rq->thread, NULL);
+	free(rq->lines);
+}
 
-	if (count >= 128)
-		bits += encode_prefix(data, len, bitpos, count);
-	count %= 128;
-	if (prev8_flag_change) {
-		put_bits(data, len, bitpos, 3, 0b110);
-		bits += 3;
-		bits += 7;////penalty
+/* start reading num_lines lines of a page (of the source line length), the reader must be idle */
+int reader_request(struct read_queue *rq, int num_lines) {
+	if (rq->line_len != rq->src->line_len) {
+		free(rq->lines);
+		rq->line_len = rq->src->line_len;
+		rq->lines = malloc(READ_QUEUE_LINES * rq->line_len);
+		if (!rq->lines)
+			return -1;
 	}
-	put_bits(data, len, bitpos, 1, 0b0);
-	bits += 1;
+	pthread_mutex_lock(&rq->lock);
+	rq->head = rq->count = 0;
+	rq->requested = num_lines;
+	rq->end = (num_lines <= 0);
+	pthread_cond_signal(&rq->request);
+	pthread_mutex_unlock(&rq->lock);
 
-	return bits + encode_number(data, len, bitpos, count);
+	return 0;
 }
 
-int encode_dict(char **data, u16 *len, u8 *bitpos, u8 pos) {
-	put_bits(data, len, bitpos, 2, 0b10);
-	put_bits(data, len, bitpos, 4, ~pos & 0b1111);
+/* wait until the reader is idle, discarding lines not used by the encoder */
+void reader_finish(struct read_queue *rq) {
+	pthread_mutex_lock(&rq->lock);
+	while (true) {
+		while (!rq->count && !rq->end)
+			pthread_cond_wait(&rq->not_empty, &rq->lock);
+		if (!rq->count)
+			break;
+		rq->head = (rq->head + 1) % READ_QUEUE_LINES;
+		rq->count--;
+		pthread_cond_signal(&rq->not_full);
+	}
+	pthread_mutex_unlock(&rq->lock);
+}
 
-	return 2 + 4;
+bool read_queued_line(struct read_queue *rq, u8 *line) {
+	u64 t;
+
+	pthread_mutex_lock(&rq->lock);
+	if (!rq->count && !rq->end) {
+		t = time_ns();
+		while (!rq->count && !rq->end)
+			pthread_cond_wait(&rq->not_empty, &rq->lock);
+		rq->empty_ns += time_ns() - t;
+	}
+	if (!rq->count) {
+		pthread_mutex_unlock(&rq->lock);
+		return false;
+	}
+	memcpy(line, rq->lines + rq->head * rq->line_len, rq->line_len);
+	rq->head = (rq->head + 1) % READ_QUEUE_LINES;
+	rq->count--;
+	pthread_cond_signal(&rq->not_full);
+	pthread_mutex_unlock(&rq->lock);
+
+	return true;
 }
 
-int encode_80(char **data, u16 *len, u8 *bitpos, int count, __attribute__((unused)) bool *prev8_flag, __attribute__((unused)) bool *twobyte_flag, __attribute__((unused)) int param) {
-	put_bits(data, len, bitpos, 5, 0b11110);
+/*
+ * next line if it can be encoded where it is (line_len bytes followed by HISTORY_PAD readable
+ * bytes), NULL if it has to be read by read_line()
+ */
+const u8 *read_line_at(struct raster_source *src) {
+	const u8 *line = src->page;
+
+	if (src->queue)
+		return NULL;
+	if (src->page) {
+		if (src->page_lines <= 0 || src->page_end - line < src->line_len + HISTORY_PAD)
+			return NULL;
+		src->page += src->line_len;
+		src->page_lines--;
+		return line;
+	}
+	if (src->map && src->line_len == src->line_len_file)
+		return raster_map_line_at(src->map, src->line_len);
 
-	return 5 + encode_number(data, len, bitpos, count);
+	return NULL;
 }
 
-struct print_encoder {
-	char *name;
-	int (*get_count)(int line_pos, int line_num, int param);
-	int (*encode)(char **data, u16 *len, u8 *bitpos, int count, bool *prev8_flag, bool *twobyte_flag, int param);
-	int param;
-	int ratio;
-	int count;
-};
+/* read next line padded with zeros to line_len, false if there is none */
+bool read_line(struct raster_source *src, u8 *line) {
+	u16 line_len = src->line_len, line_len_file = src->line_len_file;
+
+	if (src->queue)
+		return read_queued_line(src->queue, line);
+	if (src->page) {
+		if (src->page_lines <= 0)
+			return false;
+		memcpy(line, src->page, line_len);
+		src->page += line_len;
+		src->page_lines--;
+		return true;
+	}
+	/* clear only the padding, the rest is overwritten */
+	memset(line + line_len_file, 0, line_len - line_len_file);
+	if (src->map)
+		return raster_map_line(src->map, line);
+	if (src->ras) {
+		DBG("cupsRasterReadPixels(%p, %p, %d)\n", src->ras, line, line_len_file);
+		return cupsRasterReadPixels(src->ras, line, line_len_file) != 0;
+	}
+	if (feof(src->f))
+		return false;
+	/* partial line at the end is padded with zeros */
+	size_t len = fread(line, 1, line_len_file, src->f);
+	memset(line + len, 0, line_len_file - len);
 
-struct print_encoder encoders[] = {
-	{ .name = "@-80", .get_count = count_this, .encode = encode_80, .param = -80 },
-	{ .name = "run_len", .get_count = count_run_length, .encode = encode_last, .param = -1 },
-	{ .name = "@-2", .get_count = count_this, .encode = encode_last, .param = -2 },
-	{ .name = "previous[3]", .get_count = count_prev, .encode = encode_prev, .param = 3 },
-	{ .name = "previous[7]", .get_count = count_prev, .encode = encode_prev, .param = 7 },
-};
+	return len > 0;
+}
 
-u16 encode_print_data_canon(int *num_lines, bool last, FILE *f, cups_raster_t *ras, char *out) {
-	u8 bitpos = 0;
-	u16 len = 0;
-	int line_num = 0;
+/*
+ * Encode up to num_lines lines, stopping before the first line that would make the output
+ * exceed the budget. That line is kept for the next strip and last is cleared.
+ */
+u16 encode_print_data_canon(struct carps_encoder *enc, struct raster_source *src, int *num_lines, bool *last, char *out) {
 	DBG("num_lines=%d\n", *num_lines);
-	u8 dictionary[DICT_SIZE];
-	bool prev8_flag = false;
-	bool twobyte_flag = false;
-#ifdef DEBUG
-	char *start = out;
-#endif
-	memset(dictionary, 0xaa, DICT_SIZE);
-
-	while (((f && !feof(f)) || (ras)) && line_num < *num_lines) {
-		memset(cur_line, 0, line_len);
-		if (ras) {
-			DBG("cupsRasterReadPixels(%p, %p, %d)\n", ras, cur_line, line_len_file);
-			if (cupsRasterReadPixels(ras, cur_line, line_len_file) == 0)
-				break;
-		} else
-			fread(cur_line, 1, line_len_file, f);
-		DBG("line_num=%d (global=%d)\n", line_num, global_line_num);
-		line_pos = 0;
-
-		while (line_pos < line_len) {
-			DBG("line_pos=%d, outpos=%d: ", line_pos, global_outpos + out - start);
-			/* try all compression methods */
-			for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++) {
-				int bits = 0;
-				encoders[i].count = encoders[i].get_count(line_pos, line_num, encoders[i].param);
-				if (encoders[i].count > 1) {
-					bits = encoders[i].encode(NULL, NULL, NULL, encoders[i].count, &prev8_flag, &twobyte_flag, encoders[i].param);
-					encoders[i].ratio = bits ? encoders[i].count * 80 / bits : 0;
-				} else
-					encoders[i].ratio = 0;
-				DBG("%s=%d, %d bits, ratio=%d\n", encoders[i].name, encoders[i].count, bits, encoders[i].ratio);
-			}
-			/* choose the best one */
-			int best_ratio = 0;
-			int best_encoder;
-			for (unsigned int i = 0; i < ARRAY_SIZE(encoders); i++)
-				if (encoders[i].ratio > best_ratio) {
-					best_ratio = encoders[i].ratio;
-					best_encoder = i;
-				}
-			/* if found, use it */
-			if (best_ratio) {
-				DBG("Using %s\n", encoders[best_encoder].name);
-				encoders[best_encoder].encode(&out, &len, &bitpos, encoders[best_encoder].count, &prev8_flag, &twobyte_flag, encoders[best_encoder].param);
-				line_pos += encoders[best_encoder].count;
-				continue;
-			}
-			/* dictionary */
-			int pos = dict_search(cur_line[line_pos], dictionary);
-			if (pos >= 0) {
-				DBG("dict @%d\n", pos);
-				encode_dict(&out, &len, &bitpos, pos);
-				dict_add(cur_line[line_pos], dictionary);
-				line_pos++;
-				continue;
-			}
-			/* zero byte */
-			if (cur_line[line_pos] == 0x00) {
-				DBG("zero\n");
-				put_bits(&out, &len, &bitpos, 8, 0b11111101);
-				dict_add(0, dictionary);
-				line_pos++;
-				continue;
-			}
-			/* fallback: byte immediate */
-			put_bits(&out, &len, &bitpos, 4, 0b1101);
-			put_bits(&out, &len, &bitpos, 8, cur_line[line_pos]);
-			dict_add(cur_line[line_pos], dictionary);
-			line_pos++;
+	carps_strip_begin(enc, (u8 *)out, BUF_SIZE - 1);
+	while (enc->strip_lines < *num_lines) {
+		const u8 *line = read_line_at(src);
+		if (!line && !read_line(src, carps_encoder_line(enc)))
+			break;
+		if (!(line ? carps_strip_push_line_at(enc, line) : carps_strip_push_line(enc))) {
+			*last = false;
+			break;
 		}
-		memcpy(last_lines[7], last_lines[6], line_len);
-		memcpy(last_lines[6], last_lines[5], line_len);
-		memcpy(last_lines[5], last_lines[4], line_len);
-		memcpy(last_lines[4], last_lines[3], line_len);
-		memcpy(last_lines[3], last_lines[2], line_len);
-		memcpy(last_lines[2], last_lines[1], line_len);
-		memcpy(last_lines[1], last_lines[0], line_len);
-		memcpy(last_lines[0], cur_line, line_len);
-		line_pos = 0;
-		line_num++;
-		global_line_num++;
-	}
-	/* block end marker */
-	DBG("block end\n");
-	put_bits(&out, &len, &bitpos, 8, 0b11111110);
-	put_bits(&out, &len, &bitpos, 2, 0b00);
-	/* fill unused bits in last byte */
-	DBG("%d unused bits\n", 8 - bitpos);
-	put_bits(&out, &len, &bitpos, 8 - bitpos, 0xff);
-
-	if (last) {
-		put_bits(&out, &len, &bitpos, 8, 0xfe);
-		put_bits(&out, &len, &bitpos, 8, 0x7f);
-		put_bits(&out, &len, &bitpos, 8, 0xff);
-		put_bits(&out, &len, &bitpos, 8, 0xff);
-	}
-
-	*num_lines = line_num;
+	}
+	u32 len = carps_strip_end(enc, *last);
+	if (enc->bw.overflow)
+		ERR("print data do not fit into %d bytes, output truncated", enc->bw.size);
+
+	*num_lines = enc->strip_lines;
 
 	return len;
 }
+/*
+ * Parallel encoding: strips are independent (Canon dictionary, flags and line history, G4
+ * reference line are reset for each strip) so lines of a page are buffered and each strip is
+ * handed to a pool of worker threads, each with its own encoders, as soon as its lines are
+ * read. Strips are written in order as they complete.
+ */
+/* Canon strip encoded by a worker */
+struct canon_strip {
+	struct canon_strip *next;
+	int num_lines;
+	bool last;
+	char *buf;	/* BUF_SIZE + 1, passed to write_strip() */
+	u32 len;
+	bool overflow;	/* truncated */
+};
 
-struct g4_client_data {
-	bool do_writes;
-	char *out;
-	int pos;
+struct strip_job {
+	struct raster_source src;
+	int num_lines;
+	bool last;
+	struct canon_strip *strips;	/* Canon: more than one if a line does not fit */
+	struct carps_strip_key key;	/* Canon: of job lines if looked up in the strip cache */
+	bool cache_put;		/* Canon: add strip to the cache when written */
+	u8 *g4_data;		/* G4: encoded strip */
+	u32 g4_len;
+	bool done;
 };
 
-tmsize_t g4_write(thandle_t handle, void *buf, tmsize_t count) {
-	struct g4_client_data *g4 = handle;
+struct strip_worker {
+	pthread_t thread;
+	struct strip_pool *pool;
+	struct carps_encoder enc;
+	struct carps_g4_encoder g4;
+};
 
-	if (g4->do_writes) {
-		memcpy(g4->out + g4->pos, buf, count);
-		g4->pos += count;
-	}
+struct strip_pool {
+	int num_threads;
+	struct strip_worker *workers;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* new jobs or quit */
+	pthread_cond_t done;	/* job done */
+	struct strip_job *jobs;
+	int num_jobs, max_jobs, next_job;
+	bool quit;
+	enum carps_compression compression;
+	u8 *page;	/* buffered page */
+	size_t page_size;
+};
+
+/*
+ * Statistics: summary of each page and of the whole job in the log and, if CARPS_STATS is set
+ * in the environment, the job summary with all pages appended to that file as a JSON line.
+ */
+struct job_stats {
+	u64 start;
+	int pages;
+	u64 raster_bytes, bytes;
+	unsigned int strips, blocks;
+	struct encoder_stats enc;	/* all encoders at the end of the last page */
+	struct carps_strip_cache_stats cache;	/* strip cache at the end of the last page */
+	FILE *json_pages;	/* page objects, in json_buf */
+	char *json_buf;
+	size_t json_len;
+};
 
-	return count;
+/* job being converted: settings, current page and all stages */
+struct filter {
+	enum carps_compression compression;
+	bool max_compression;
+	int strip_budget;	/* Canon: output bytes per strip, 0 = fixed number of lines */
+	int g4_strip_lines;	/* 0 = whole page */
+	bool use_strip_cache;	/* Canon with fixed strips: encoded strips reused for strips with the same lines */
+	int width, height, dpi;
+	u16 line_len, line_len_file;
+	int cur_page;	/* page of the last strip written by the pool */
+	struct output out;
+	struct carps_stream stream;	/* encoder without threads */
+	struct strip_pool pool;
+	struct read_queue reader;
+	struct carps_strip_cache strip_cache;
+	struct job_stats stats;
+};
+
+/* build strip header(s) starting with 0x01 byte, returns their length */
+int strip_headers(struct filter *flt, char *header, int page, int num_lines, bool last, u32 len) {
+	bool page_header = (page != flt->cur_page);
+
+	flt->cur_page = page;
+	flt->out.page.strips++;
+
+	return carps_strip_headers(header, page_header, flt->dpi, flt->width, num_lines, last, len, flt->compression);
 }
 
-tmsize_t dummy_read(__attribute__((unused)) thandle_t handle, __attribute__((unused)) void *buf, __attribute__((unused)) tmsize_t count) {
-	return 0;
+/* write strip header(s) and Canon print data, buf must have space for 1 more byte and is freed */
+void write_strip(struct filter *flt, int page, int num_lines, bool last, char *buf, u32 len) {
+	char header[MAX_DATA_LEN];
+	int headers_len = strip_headers(flt, header, page, num_lines, last, len);
+
+	buf[len++] = 0x80;	/* add strip data end marker */
+	write_print_data(&flt->out, (u8 *)header, headers_len, (u8 *)buf, len);
 }
 
-toff_t dummy_seek(__attribute__((unused)) thandle_t handle, __attribute__((unused)) toff_t offset, __attribute__((unused)) int whence) {
-	return 0;
+/* write strip header(s) and G4 print data, data is freed */
+void write_strip_g4(struct filter *flt, int page, int num_lines, u8 *data, u32 len) {
+	char header[MAX_DATA_LEN];
+	int headers_len = strip_headers(flt, header, page, num_lines, false, 0);
+
+	write_print_data(&flt->out, (u8 *)header, headers_len, data, len);
 }
 
-int dummy_close(__attribute__((unused)) thandle_t handle) {
-	return 0;
+/* output finished strips of the stream, their data are written in place */
+void write_stream(struct filter *flt) {
+	struct carps_stream_data d;
+
+	while (carps_stream_pull(&flt->stream, &d))
+		write_print_data(&flt->out, (u8 *)d.headers, d.headers_len, d.data, d.len);
+	flt->out.page.strips += flt->stream.strips;
+	flt->stream.strips = 0;
 }
 
-toff_t dummy_size(__attribute__((unused)) thandle_t handle) {
-	return 0;
+/*
+ * encode page without threads: lines are pushed to the stream, finished strips are written,
+ * lines of a mapped raster are pushed where they are
+ */
+int encode_page_stream(struct filter *flt, int page, struct raster_source *src) {
+	struct carps_stream *s = &flt->stream;
+	int lines;
+
+	if (carps_stream_page(s, page, flt->width, flt->height, flt->dpi))
+		goto err;
+	for (lines = 0; lines < flt->height; lines++) {
+		const u8 *line = read_line_at(src);
+		if (!line && !read_line(src, carps_stream_line(s)))
+			break;
+		if (line ? carps_stream_push_line_at(s, line) : carps_stream_push_line(s))
+			goto err;
+		write_stream(flt);
+	}
+	if (carps_stream_page_end(s))
+		goto err;
+	write_stream(flt);
+	if (s->overflow)
+		ERR("print data do not fit into %d bytes, output truncated", BUF_SIZE - 1);
+	s->overflow = false;
+
+	return lines;
+err:
+	fprintf(stderr, "Memory allocation error\n");
+	return -1;
 }
 
-/* (ab)use LibTIFF to produce raw G4 output into memory */
-u32 encode_print_data_g4(FILE *f, cups_raster_t *ras, char *out) {
-	struct g4_client_data g4 = { .do_writes = false, .out = out };
-	/* open for write, disable MMIO */
-	TIFF *tif = TIFFClientOpen("", "wm", &g4, dummy_read, g4_write, dummy_seek, dummy_close, dummy_size, NULL, NULL);
-	if (!tif)
-		return 0;
+/* encode job lines into one or more Canon strips */
+void encode_job_canon(struct carps_encoder *se, struct strip_job *job) {
+	struct canon_strip **tail = &job->strips;
 
-	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
-	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
-	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 1);
-	TIFFSetField(tif, TIFFTAG_FILLORDER, FILLORDER_LSB2MSB);
-	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_CCITTFAX4);
-	/* produce raw G4 data */
-	g4.do_writes = true;
-	int line = 0;
-	while ((f && !feof(f)) || (ras)) {
-		memset(cur_line, 0, line_len);
-		if (ras) {
-			DBG("cupsRasterReadPixels(%p, %p, %d)\n", ras, cur_line, line_len_file);
-			if (cupsRasterReadPixels(ras, cur_line, line_len_file) == 0)
-				break;
-		} else
-			fread(cur_line, 1, line_len_file, f);
-		if (TIFFWriteScanline(tif, cur_line, line++, 0) != 1)
+	*tail = NULL;
+	for (int lines = 0; lines < job->num_lines && (se->carry || job->src.page_lines > 0); ) {
+		struct canon_strip *strip = malloc(sizeof(struct canon_strip));
+		if (!strip || !(strip->buf = malloc(BUF_SIZE + 1))) {
+			fprintf(stderr, "Memory allocation error\n");
+			exit(2);
+		}
+		strip->num_lines = job->num_lines - lines;
+		strip->last = job->last;
+		strip->len = encode_print_data_canon(se, &job->src, &strip->num_lines, &strip->last, strip->buf);
+		strip->overflow = se->bw.overflow;
+		strip->next = NULL;
+		*tail = strip;
+		tail = &strip->next;
+		lines += strip->num_lines;
+	}
+}
+
+/* encode job lines into a G4 strip, padded with white lines to the planned lines as in the stream */
+void encode_job_g4(struct carps_g4_encoder *g, struct strip_job *job) {
+	bool page_end = false;
+
+	carps_g4_strip_begin(g);
+	while (g->strip_lines < job->num_lines) {
+		const u8 *line = page_end ? NULL : read_line_at(&job->src);
+		if (line) {
+			carps_g4_push_line_at(g, line);
+			continue;
+		}
+		u8 *buf = carps_g4_line(g);
+		if (page_end || (page_end = !read_line(&job->src, buf)))
+			memset(buf, 0, g->history.line_len);
+		carps_g4_push_line(g);
+	}
+	job->g4_data = carps_g4_strip_end(g, &job->g4_len);
+	if (!job->g4_data) {
+		fprintf(stderr, "Memory allocation error\n");
+		exit(2);
+	}
+}
+
+void *strip_worker(void *arg) {
+	struct strip_worker *w = arg;
+	struct strip_pool *pool = w->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (!pool->quit && pool->next_job >= pool->num_jobs)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->quit)
 			break;
+		struct strip_job *job = &pool->jobs[pool->next_job++];
+		if (job->done)	/* found in strip cache */
+			continue;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (pool->compression == COMPRESS_G4)
+			encode_job_g4(&w->g4, job);
+		else
+			encode_job_canon(&w->enc, job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		pthread_cond_broadcast(&pool->done);
 	}
-	TIFFFlushData(tif);
-	g4.do_writes = false;
-	/* closing would write data but we discard it */
-	TIFFClose(tif);
+	pthread_mutex_unlock(&pool->lock);
 
-	return g4.pos;
+	return NULL;
 }
 
-int encode_strip(int page, int height, FILE *f, cups_raster_t *ras, enum carps_compression compression) {
-	int num_lines = height;
-	int headers_len = 1;
-	char *buf;
-	char header[MAX_DATA_LEN];
+int strip_pool_start(struct strip_pool *pool, int num_threads) {
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->workers = calloc(num_threads, sizeof(struct strip_worker));
+	if (!pool->workers)
+		return -1;
+	for (pool->num_threads = 0; pool->num_threads < num_threads; pool->num_threads++) {
+		struct strip_worker *w = &pool->workers[pool->num_threads];
+		w->pool = pool;
+		if (pthread_create(&w->thread, NULL, strip_worker, w))
+			return -1;
+	}
+
+	return 0;
+}
+
+/* stop worker threads */
+void strip_pool_stop(struct strip_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->num_threads; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+		carps_encoder_free(&pool->workers[i].enc);
+		carps_g4_free(&pool->workers[i].g4);
+	}
+	free(pool->jobs);
+	free(pool->workers);
+	free(pool->page);
+}
+
+/* number of encoder threads from EncoderThreads tuning option, 1 = no threads */
+int encoder_threads(const char *value) {
+	int n;
+
+	if (!strcmp(value, "Auto"))
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	else
+		n = atoi(value);
+
+	return (n < 1) ? 1 : n;
+}
+
+/* number of lines in job starting at line start: one planned strip, as the stream uses */
+int strip_lines(struct filter *flt, int start, bool *last) {
+	int height = flt->height;
+
+	*last = false;
+	if (flt->compression == COMPRESS_G4)
+		return (flt->g4_strip_lines && flt->g4_strip_lines < height - start) ? flt->g4_strip_lines : height - start;
+
+	return carps_strip_lines(&flt->pool.workers[0].enc, height - start, last);
+}
+
+/* look up job lines in the strip cache, true if found: job has the cached strip */
+bool strip_cache_job(struct filter *flt, struct strip_job *job, int num_lines) {
+	const u8 *data;
 	u32 len;
-	static int cur_page = 1;
-
-	header[0] = 0x01;
-	/* add page header at start of each page (except the first one) */
-	if (page != cur_page) {
-		cur_page = page;
-		headers_len += sprintf(header + headers_len, "\x1b[11h\x1b[?7;%d I\x1b[%d;1;0;%d;;%d;0'c", dpi, dpi, (compression == COMPRESS_G4) ? 256 : 32, (compression == COMPRESS_G4) ? 0 : 64);
-	}
-	/* encode print data first as we need the length and line count */
-	if (compression == COMPRESS_G4) {
-		/* compress entire page into a single strip */
-		/* in worst case, G4 output can be triple the size of the input + some overhead */
-		buf = malloc(line_len_file * height * 31 / 10 );
-		if (!buf) {
-			fprintf(stderr, "Memory allocation error\n");
-			return 0;
-		}
-		len = encode_print_data_g4(f, ras, buf);
-		/* strip header */
-		headers_len += sprintf(header + headers_len, "\x1b[;%d;%d;16.P", width, height);
-	} else {
-		/* compress only as much lines as fits into BUF_SIZE */
-		buf = malloc(BUF_SIZE + 1);
-		if (!buf) {
-			fprintf(stderr, "Memory allocation error\n");
-			return 0;
+
+	carps_strip_key(&job->key, job->src.page, flt->line_len, num_lines, job->last, flt->max_compression);
+	data = carps_strip_cache_get(&flt->strip_cache, &job->key, &len);
+	job->cache_put = !data;
+	if (!data)
+		return false;
+
+	struct canon_strip *strip = malloc(sizeof(struct canon_strip));
+	if (!strip || !(strip->buf = malloc(BUF_SIZE + 1))) {
+		fprintf(stderr, "Memory allocation error\n");
+		exit(2);
+	}
+	memcpy(strip->buf, data, len);
+	strip->num_lines = num_lines;
+	strip->last = job->last;
+	strip->len = len;
+	strip->overflow = false;
+	strip->next = NULL;
+	job->strips = strip;
+
+	return true;
+}
+
+void write_job(struct filter *flt, int page, struct strip_job *job) {
+	if (flt->compression == COMPRESS_G4)
+		write_strip_g4(flt, page, job->num_lines, job->g4_data, job->g4_len);
+	else
+		for (struct canon_strip *strip = job->strips, *next; strip; strip = next) {
+			next = strip->next;
+			/* cached only if all job lines fit into one strip */
+			if (job->cache_put && strip == job->strips && !next && !strip->overflow &&
+			    strip->num_lines == job->key.num_lines && strip->last == job->key.last)
+				carps_strip_cache_put(&flt->strip_cache, &job->key, (u8 *)strip->buf, strip->len);
+			write_strip(flt, page, strip->num_lines, strip->last, strip->buf, strip->len);
+			free(strip);
 		}
-		bool last = false;
-		num_lines = BUF_SIZE / line_len;
-		if (num_lines > height) {
-			DBG("num_lines := %d\n", height);
-			num_lines = height;
-			last = true;
+}
+
+/* encode page in strips using the pool, returns number of lines */
+int encode_page_parallel(struct filter *flt, int page, struct raster_source *src) {
+	struct strip_pool *pool = &flt->pool;
+	int lines = 0, num_jobs = 0, written = 0, height = flt->height;
+	u16 line_len = flt->line_len;
+	bool last;
+
+	/* workers must be idle here */
+	for (int i = 0; i < pool->num_threads; i++) {
+		struct strip_worker *w = &pool->workers[i];
+		if (flt->compression == COMPRESS_G4 ? carps_g4_init(&w->g4, flt->width) :
+		    carps_encoder_init(&w->enc, line_len, flt->max_compression, flt->strip_budget))
+			goto err;
+	}
+	if (pool->page_size < (size_t)height * line_len) {
+		free(pool->page);
+		pool->page_size = (size_t)height * line_len;
+		/* lines are encoded in place */
+		pool->page = malloc(pool->page_size + HISTORY_PAD);
+		if (!pool->page)
+			goto err;
+	}
+	for (int start = 0; start < height; num_jobs++)
+		start += strip_lines(flt, start, &last);
+	if (num_jobs > pool->max_jobs) {
+		struct strip_job *jobs = realloc(pool->jobs, num_jobs * sizeof(struct strip_job));
+		if (!jobs)
+			goto err;
+		pool->jobs = jobs;
+		pool->max_jobs = num_jobs;
+	}
+	pool->compression = flt->compression;
+
+	/* read strips and hand them to workers, write strips done meanwhile */
+	num_jobs = 0;
+	for (int start = 0, num_lines; start < height && lines == start; start += num_lines) {
+		struct strip_job *job = &pool->jobs[num_jobs];
+		num_lines = strip_lines(flt, start, &job->last);
+		int strip_lines_read;
+		/* mapped raster without padding is encoded in place */
+		const u8 *strip = src->map ? raster_map_lines(src->map, line_len, num_lines, &strip_lines_read) : NULL;
+		const u8 *strip_end = pool->page + pool->page_size + HISTORY_PAD;
+		if (strip) {
+			lines += strip_lines_read;
+			strip_end = src->map->data + src->map->size;
+		} else {
+			strip = pool->page + (size_t)start * line_len;
+			while (lines < start + num_lines && read_line(src, pool->page + (size_t)lines * line_len))
+				lines++;
 		}
-		len = encode_print_data_canon(&num_lines, last, f, ras, buf);
-		/* strip header */
-		headers_len += sprintf(header + headers_len, "\x1b[;%d;%d;15.P", width, num_lines);
-		/* print data header */
-		struct carps_print_header *ph = (void *)header + headers_len;
-		memset(ph, 0, sizeof(struct carps_print_header));
-		ph->one = 0x01;
-		ph->two = 0x02;
-		ph->four = 0x04;
-		ph->eight = 0x08;
-		ph->magic = 0x50;
-		ph->last = last ? 0 : 1;
-		ph->data_len = cpu_to_le16(len);
-		headers_len += sizeof(struct carps_print_header);
-		buf[len++] = 0x80;	/* add strip data end marker */
-	}
-
-	if (headers_len + len <= MAX_DATA_LEN) {
-		/* write header(s) and print data in one block */
-		memcpy(header + headers_len, buf, len);
-		write_block(CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, header, headers_len + len, stdout);
-	} else {
-		/* write header(s) as a separate block */
-		write_block(CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, header, headers_len, stdout);
-		/* make space for the first 0x01 byte that will be inserted */
-		char *buf_pos = buf + 1;
-		memmove(buf_pos, buf, len);
-		/* then write data blocks at most MAX_BLOCK_LEN bytes long */
-		while (len) {
-			/* insert 0x01 byte at the beginning of each continuing block */
-			buf_pos--;
-			len++;
-			buf_pos[0] = 0x01;
-			int block_len = (len > MAX_DATA_LEN) ? MAX_DATA_LEN : len;
-			fprintf(stderr, "len=%d, block_len=%d\n", len, block_len);
-			write_block(CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, buf_pos, block_len, stdout);
-			buf_pos += block_len;
-			len -= block_len;
+		if (lines == start)
+			break;
+		job->num_lines = num_lines;
+		job->src = (struct raster_source) {
+			.page = strip,
+			.page_lines = lines - start,
+			.page_end = strip_end,
+			.line_len = line_len,
+			.line_len_file = line_len,
+		};
+		job->cache_put = false;
+		job->done = flt->use_strip_cache && flt->compression == COMPRESS_CANON && strip_cache_job(flt, job, lines - start);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->num_jobs = ++num_jobs;
+		pthread_cond_broadcast(&pool->work);
+		while (written < num_jobs && pool->jobs[written].done) {
+			pthread_mutex_unlock(&pool->lock);
+			write_job(flt, page, &pool->jobs[written++]);
+			pthread_mutex_lock(&pool->lock);
 		}
+		pthread_mutex_unlock(&pool->lock);
 	}
 
-	free(buf);
-
-	return num_lines;
-}
-
-enum carps_paper_size encode_paper_size(const char *paper_size_name) {
-	if (!strcmp(paper_size_name, "A4"))
-		return PAPER_A4;
-	else if (!strcmp(paper_size_name, "A5"))
-		return PAPER_A5;
-	else if (!strcmp(paper_size_name, "B5"))
-		return PAPER_B5;
-	else if (!strcmp(paper_size_name, "Letter"))
-		return PAPER_LETTER;
-	else if (!strcmp(paper_size_name, "Legal"))
-		return PAPER_LEGAL;
-	else if (!strcmp(paper_size_name, "Executive"))
-		return PAPER_EXECUTIVE;
-	else if (!strcmp(paper_size_name, "Monarch"))
-		return PAPER_ENV_MONAR;
-	else if (!strcmp(paper_size_name, "Env10"))
-		return PAPER_ENV_COM10;
-	else if (!strcmp(paper_size_name, "DL"))
-		return PAPER_ENV_DL;
-	else if (!strcmp(paper_size_name, "C5"))
-		return PAPER_ENV_C5;
-	else
-		return PAPER_CUSTOM;
+	pthread_mutex_lock(&pool->lock);
+	for (; written < num_jobs; written++) {
+		while (!pool->jobs[written].done)
+			pthread_cond_wait(&pool->done, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+		write_job(flt, page, &pool->jobs[written]);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pool->num_jobs = pool->next_job = 0;
+	pthread_mutex_unlock(&pool->lock);
+
+	return lines;
+err:
+	fprintf(stderr, "Memory allocation error\n");
+	return -1;
 }
 
-void fill_print_data_header(char *buf, unsigned int copies, unsigned int dpi, unsigned int weight, const char *paper_size_name, unsigned int paper_width, unsigned int paper_height, enum carps_compression compression) {
-	char tmp[100];
-	enum carps_paper_size paper_size = encode_paper_size(paper_size_name);
-
-//	\x01.%@.P42;600;1J;ImgColor.\.[11h.[?7;600 I.[20't.[14;;;;;;p.[?2h.[1v.[600;1;0;32;;64;0'c
-	buf[0] = 1;
-	buf[1] = 0;
-	strcat(buf, "\x1b%@");
-	/* ??? and resolution */
-	sprintf(tmp, "\x1bP42;%d;1J;ImgColor", dpi);
-	strcat(buf, tmp);
-	/* ??? */
-	strcat(buf, "\x1b\\");
-	/* ??? */
-	strcat(buf, "\x1b[11h");
-	/* ??? and resolution */
-	sprintf(tmp, "\x1b[?7;%d I", dpi);
-	strcat(buf, tmp);
-	/* paper weight */
-	sprintf(tmp, "\x1b[%d't", weight);
-	strcat(buf, tmp);
-	/* paper size */
-	if (paper_size == PAPER_CUSTOM) {
-		/* compute custom paper size in print dots */
-		int margin = 2 * dpi / 10;
-		paper_height = paper_height * dpi / POINTS_PER_INCH;
-		paper_width = paper_width * dpi / POINTS_PER_INCH;
-		sprintf(tmp, "\x1b[%d;%d;%d;%d;%d;%d;%dp", paper_size, paper_height, paper_width, margin, margin, margin, margin);
-	} else
-		sprintf(tmp, "\x1b[%d;;;;;;p", paper_size);
-	strcat(buf, tmp);
-	/* ??? */
-	strcat(buf, "\x1b[?2h");
-	/* number of copies */
-	sprintf(tmp, "\x1b[%dv", copies);
-	strcat(buf, tmp);
-	/* resolution and ??? */
-	sprintf(tmp, "\x1b[%d;1;0;%d;;%d;0'c", dpi, (compression == COMPRESS_G4) ? 256 : 32, (compression == COMPRESS_G4) ? 0 : 64);
-	strcat(buf, tmp);
-}
-
-void fill_doc_time(struct carps_time *doc_time, struct tm *tm) {
-	doc_time->year = (1900 + tm->tm_year) >> 4;
-	doc_time->year_month = ((1900 + tm->tm_year) << 4) | (tm->tm_mon + 1);
-	doc_time->day = (tm->tm_mday << 3) | tm->tm_wday;
-	doc_time->hour = tm->tm_hour;
-	doc_time->min = tm->tm_min;
-	doc_time->sec_msec = tm->tm_sec << 2;
-}
-
-void write_doc_info(char *buf, char *doc_title, char *user_name, time_t timestamp) {
-	struct carps_doc_info *info = (void *)buf;
-	struct carps_time *doc_time;
-	/* document beginning */
-	u8 begin_data[] = { 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_BEGIN, begin_data, sizeof(begin_data), stdout);
-	/* document info - title */
-	info->type = cpu_to_be16(CARPS_DOC_INFO_TITLE);
-	info->unknown = cpu_to_be16(0x11);
-	info->data_len = strlen(doc_title) > 255 ? 255 : strlen(doc_title);
-	strncpy(buf + sizeof(struct carps_doc_info), doc_title, 255);
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_DOC_INFO, buf, sizeof(struct carps_doc_info) + strlen(doc_title), stdout);
-	/* document info - user name */
-	info->type = cpu_to_be16(CARPS_DOC_INFO_USER);
-	info->unknown = cpu_to_be16(0x11);
-	info->data_len = strlen(user_name) > 255 ? 255 : strlen(user_name);
-	strncpy(buf + sizeof(struct carps_doc_info), user_name, 255);
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_DOC_INFO, buf, sizeof(struct carps_doc_info) + strlen(user_name), stdout);
-	/* document info - time */
-	struct tm *tm = gmtime(&timestamp);
-	info->type = cpu_to_be16(CARPS_DOC_INFO_TIME);
-	doc_time = (void *)buf + 2;
-	memset(doc_time, 0, sizeof(struct carps_time));
-	if (timestamp)
-		fill_doc_time(doc_time, tm);
-	else {
-		/* MF5730 driver does not fill the time data, maybe because of a bug? */
-		/* Printer accepts data with time so we always fill it in. */
-		/* But we use this for test purposes so the output file does not change with time */
-		doc_time->day = 7;
-	}
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_DOC_INFO, buf, sizeof(struct carps_time) + 2, stdout);
-}
-
-void write_doc_info_new(char *buf, char *doc_title, char *user_name, time_t timestamp) {
-	char *ptr = buf;
-	struct carps_doc_info_new *info;
-	struct carps_time *doc_time;
-	int len;
-	/* 4 records */
-	u16 *record_count = (void *)ptr;
-	*record_count = cpu_to_be16(4);
-	ptr += 2;
-	/* unknown record */
-	info = (void *)ptr;
-	info->type = cpu_to_be16(0xf0);
-	info->data_len = cpu_to_be16(1);
-	info->data[0] = 0x01;
-	ptr += sizeof(struct carps_doc_info_new) + 1;
-	/* document info - title */
-	info = (void *)ptr;
-	info->type = cpu_to_be16(CARPS_DOC_INFO_TITLE);
-	len = strlen(doc_title) > 255 ? 255 : strlen(doc_title);
-	info->data_len = cpu_to_be16(len + 3);
-	info->data[0] = 0;
-	info->data[1] = 0x11;
-	info->data[2] = len;
-	strncpy((void *)&info->data[3], doc_title, 255);
-	ptr += sizeof(struct carps_doc_info_new) + 3 + len;
-	/* document info - user name */
-	info = (void *)ptr;
-	info->type = cpu_to_be16(CARPS_DOC_INFO_USER);
-	len = strlen(user_name) > 255 ? 255 : strlen(user_name);
-	info->data_len = cpu_to_be16(len + 3);
-	info->data[0] = 0;
-	info->data[1] = 0x11;
-	info->data[2] = len;
-	strncpy((void *)&info->data[3], user_name, 255);
-	ptr += sizeof(struct carps_doc_info_new) + 3 + len;
-	/* document info - time */
-	info = (void *)ptr;
-	info->type = cpu_to_be16(CARPS_DOC_INFO_TIME);
-	info->data_len = cpu_to_be16(sizeof(struct carps_time));
-	struct tm *tm = gmtime(&timestamp);
-	doc_time = (void *)info->data;
-	memset(doc_time, 0, sizeof(struct carps_time));
-	if (timestamp)
-		fill_doc_time(doc_time, tm);
-	else {
-		/* MF5730 driver does not fill the time data, maybe because of a bug? */
-		/* Printer accepts data with time so we always fill it in. */
-		/* But we use this for test purposes so the output file does not change with time */
-		doc_time->day = 7;
+/* add (or subtract) encoder statistics */
+void encoder_stats_add(struct encoder_stats *sum, const struct encoder_stats *s, bool sub) {
+	sum->lines += sub ? -s->lines : s->lines;
+	for (int i = 0; i < NUM_ENCODERS; i++)
+		sum->repeat_lines[i] += sub ? -s->repeat_lines[i] : s->repeat_lines[i];
+	for (int i = 0; i < NUM_TOKENS; i++) {
+		sum->tokens[i] += sub ? -s->tokens[i] : s->tokens[i];
+		sum->token_bits[i] += sub ? -s->token_bits[i] : s->token_bits[i];
 	}
-	ptr += sizeof(struct carps_doc_info_new) + sizeof(struct carps_time);
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_DOC_INFO_NEW, buf, ptr - buf, stdout);
 }
 
-char *ppd_get(ppd_file_t *ppd, const char *name) {
-	ppd_attr_t *attr = ppdFindAttr(ppd, name, NULL);
+/* statistics of all encoders, workers must be idle */
+void encoder_stats_sum(struct filter *flt, struct encoder_stats *sum) {
+	*sum = flt->stream.enc.stats;
+	sum->lines += flt->stream.g4.lines;
+	for (int i = 0; i < flt->pool.num_threads; i++) {
+		encoder_stats_add(sum, &flt->pool.workers[i].enc.stats, false);
+		sum->lines += flt->pool.workers[i].g4.lines;
+	}
+}
 
-	if (attr)
-		return attr->value;
-	else {
-		ppd_choice_t *choice;
-		choice = ppdFindMarkedChoice(ppd, name);
-		if (!choice)
-			return "";
-		return choice->choice;
+void log_tokens(const char *what, struct encoder_stats *s) {
+	char buf[NUM_TOKENS * 48];
+	int len = 0;
+
+	for (int i = 0; i < NUM_TOKENS; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, " %s=%u/%llu", carps_token_name(i), s->tokens[i],
+				(unsigned long long)s->token_bits[i] / 8);
+	LOG("%s tokens/bytes:%s", what, buf);
+}
+
+void json_tokens(FILE *f, struct encoder_stats *s) {
+	fprintf(f, ", \"lines\": %u, \"tokens\": {", s->lines);
+	for (int i = 0; i < NUM_TOKENS; i++)
+		fprintf(f, "%s\"%s\": %u", i ? ", " : "", carps_token_name(i), s->tokens[i]);
+	fprintf(f, "}, \"token_bits\": {");
+	for (int i = 0; i < NUM_TOKENS; i++)
+		fprintf(f, "%s\"%s\": %llu", i ? ", " : "", carps_token_name(i), (unsigned long long)s->token_bits[i]);
+	fprintf(f, "}");
+}
+
+void job_stats_start(struct job_stats *js) {
+	js->start = time_ns();
+	if (getenv("CARPS_STATS"))
+		js->json_pages = open_memstream(&js->json_buf, &js->json_len);
+}
+
+/* summary of page, after write_page_end() */
+void page_done(struct filter *flt, int page) {
+	struct job_stats *js = &flt->stats;
+	struct page_stats *ps = &flt->out.page;
+	struct encoder_stats sum, enc;
+	struct carps_strip_cache_stats cache = flt->strip_cache.stats;
+	u64 ns = time_ns() - ps->start;
+
+	encoder_stats_sum(flt, &sum);
+	enc = sum;
+	encoder_stats_add(&enc, &js->enc, true);
+	js->enc = sum;
+	cache.lookups -= js->cache.lookups;
+	cache.hits -= js->cache.hits;
+	cache.lines -= js->cache.lines;
+	js->cache = flt->strip_cache.stats;
+	/* lines of cached strips are not encoded */
+	u64 raster_bytes = (enc.lines + cache.lines) * flt->line_len_file;
+
+	LOG("page %d: encoded in %llu ms (first print data after %llu ms), %llu raster bytes, %llu CARPS bytes, %u strips, %u blocks",
+	    page, (unsigned long long)ns / 1000000,
+	    (unsigned long long)(ps->first_data ? ps->first_data - ps->start : 0) / 1000000,
+	    (unsigned long long)raster_bytes, (unsigned long long)ps->bytes, ps->strips, ps->blocks);
+	if (flt->compression == COMPRESS_CANON) {
+		char what[20];
+		snprintf(what, sizeof(what), "page %d", page);
+		log_tokens(what, &enc);
 	}
+	if (flt->use_strip_cache)
+		LOG("page %d: %u of %u strips from strip cache", page, cache.hits, cache.lookups);
+	if (js->json_pages) {
+		fprintf(js->json_pages, "%s{\"page\": %d, \"ms\": %.1f, \"first_data_ms\": %.1f, \"raster_bytes\": %llu, "
+			"\"carps_bytes\": %llu, \"strips\": %u, \"blocks\": %u",
+			js->pages ? ", " : "", page, ns / 1e6,
+			ps->first_data ? (ps->first_data - ps->start) / 1e6 : 0,
+			(unsigned long long)raster_bytes, (unsigned long long)ps->bytes, ps->strips, ps->blocks);
+		json_tokens(js->json_pages, &enc);
+		fprintf(js->json_pages, ", \"cache_lookups\": %u, \"cache_hits\": %u}", cache.lookups, cache.hits);
+	}
+
+	js->pages++;
+	js->raster_bytes += raster_bytes;
+	js->bytes += ps->bytes;
+	js->strips += ps->strips;
+	js->blocks += ps->blocks;
+}
+
+/* summary of job, all output written */
+void job_done(struct filter *flt, const char *job_id, int num_threads) {
+	struct job_stats *js = &flt->stats;
+	u64 bytes = flt->out.bytes;
+	u64 ns = time_ns() - js->start;
+	const char *file = getenv("CARPS_STATS");
+
+	INFO("%d pages in %llu ms, %llu raster bytes, %llu CARPS bytes (ratio %.1f)", js->pages,
+	     (unsigned long long)ns / 1000000, (unsigned long long)js->raster_bytes, (unsigned long long)bytes,
+	     bytes ? (double)js->raster_bytes / bytes : 0);
+	LOG("job: %u strips, %u blocks", js->strips, js->blocks);
+	if (flt->compression == COMPRESS_CANON) {
+		log_tokens("job", &js->enc);
+		unsigned int lines = 0;
+		for (int i = 0; i < NUM_ENCODERS; i++)
+			lines += js->enc.repeat_lines[i];
+		LOG("%u of %u lines encoded as a single token", lines, js->enc.lines);
+		for (int i = 0; i < NUM_ENCODERS; i++)
+			if (carps_token_repeats(i))
+				LOG("  %s: %u lines", carps_token_name(i), js->enc.repeat_lines[i]);
+	}
+	if (flt->use_strip_cache)
+		LOG("strip cache: %u of %u strips (%.1f%%, %llu lines) found", js->cache.hits, js->cache.lookups,
+		    js->cache.lookups ? 100.0 * js->cache.hits / js->cache.lookups : 0,
+		    (unsigned long long)js->cache.lines);
+	if (!js->json_pages)
+		return;
+
+	fclose(js->json_pages);
+	FILE *f = fopen(file, "a");
+	if (!f) {
+		WARN("Unable to open statistics file %s: %s", file, strerror(errno));
+		free(js->json_buf);
+		return;
+	}
+	fprintf(f, "{\"job\": \"%s\", \"compression\": \"%s\", \"max_compression\": %s, \"threads\": %d, \"pages\": %d, "
+		"\"ms\": %.1f, \"raster_bytes\": %llu, \"carps_bytes\": %llu, \"strips\": %u, \"blocks\": %u",
+		job_id, (flt->compression == COMPRESS_G4) ? "G4" : "Canon", flt->max_compression ? "true" : "false", num_threads,
+		js->pages, ns / 1e6, (unsigned long long)js->raster_bytes, (unsigned long long)bytes, js->strips, js->blocks);
+	json_tokens(f, &js->enc);
+	fprintf(f, ", \"cache_lookups\": %u, \"cache_hits\": %u, \"cache_lines\": %llu", js->cache.lookups,
+		js->cache.hits, (unsigned long long)js->cache.lines);
+	fprintf(f, ", \"page_list\": [%s]}\n", js->json_buf);
+	fclose(f);
+	free(js->json_buf);
+}
+
+/* job framing blocks */
+void job_block(void *ctx, u8 data_type, u8 block_type, const void *data, u16 data_len) {
+	write_block(ctx, data_type, block_type, data, data_len);
 }
 
 int main(int argc, char *argv[]) {
 	char buf[BUF_SIZE];
-	struct carps_print_params params;
+	struct carps_job job;
 	char tmp[100];
 #ifdef PBM
 	bool pbm_mode = false;
@@ -717,15 +1361,20 @@ int main(int argc, char *argv[]) {
 #endif
 	FILE *f;
 	cups_raster_t *ras = NULL;
+	struct raster_map raster_map = { 0 };
 	cups_page_header2_t page_header;
-	unsigned int page = 0, copies;
+	unsigned int page = 0, copies = 1;
 	int fd;
-	ppd_file_t *ppd;
+	struct job_options jo = { 0 };	/* no PPD in PBM mode */
+	struct raster_source input = { 0 }, src = { 0 };
+	int num_threads;
+	bool pipeline;
 	bool new_doc_info = false;
-	enum carps_compression compression = COMPRESS_CANON;
+	struct filter flt = { .compression = COMPRESS_CANON, .cur_page = 1 };
+
 #ifdef PBM
-	if (argc < 2 || argc == 3 || argc == 4 || argc == 5 || argc > 7) {
-		fprintf(stderr, "usage: rastertocarps <file.pbm>\n");
+	if (argc < 2 || argc == 4 || argc == 5 || argc > 7) {
+		fprintf(stderr, "usage: rastertocarps <file.pbm> [options]\n");
 #else
 	if (argc < 6 || argc > 7) {
 #endif
@@ -733,7 +1382,7 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 #ifdef PBM
-	if (argc < 3)
+	if (argc < 4)
 		pbm_mode = true;
 #endif
 	if (pbm_mode) {
@@ -751,17 +1400,18 @@ int main(int argc, char *argv[]) {
 		do
 			fgets(tmp, sizeof(tmp), f);
 		while (tmp[0] == '#');
-		sscanf(tmp, "%d %d", &width, &height);
-		DBG("width=%d height=%d\n", width, height);
-		line_len_file = DIV_ROUND_UP(width, 8);
-		line_len = ROUND_UP_MULTIPLE(line_len_file, 4);
-		cur_line = malloc(line_len);
-		for (int i = 0; i < 8; i++)
-			last_lines[i] = malloc(line_len);
+		sscanf(tmp, "%d %d", &flt.width, &flt.height);
+		DBG("width=%d height=%d\n", flt.width, flt.height);
+		flt.line_len_file = DIV_ROUND_UP(flt.width, 8);
+		flt.line_len = ROUND_UP_MULTIPLE(flt.line_len_file, 4);
+		input.f = f;
+		input.line_len = flt.line_len;
+		input.line_len_file = flt.line_len_file;
+		if (argc > 2)
+			jo.num_options = cupsParseOptions(argv[2], 0, &jo.options);
+		/* options of a test run are tuning too */
+		jo.tuning_options = true;
 	} else {
-		int n;
-		cups_option_t *options;
-
 		copies = atoi(argv[4]);
 		if (copies < 1)
 			copies = 1;
@@ -774,131 +1424,175 @@ int main(int argc, char *argv[]) {
 			}
 		} else
 			fd = 0;
-		ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
-		ppd = ppdOpenFile(getenv("PPD"));
-		if (!ppd) {
+		/* raster file is mapped, stdin (or unknown format) is read by CUPS */
+		if (fd && raster_map_open(&raster_map, fd))
+			input.map = &raster_map;
+		else {
+			ras = cupsRasterOpen(fd, CUPS_RASTER_READ);
+			input.ras = ras;
+		}
+		jo.ppd = ppdOpenFile(getenv("PPD"));
+		if (!jo.ppd) {
 			fprintf(stderr, "Unable to open PPD file %s\n", getenv("PPD"));
 			return 2;
 		}
-		ppdMarkDefaults(ppd);
-		n = cupsParseOptions(argv[5], 0, &options);
-		cupsMarkOptions(ppd, n, options);
-		cupsFreeOptions(n, options);
+		ppdMarkDefaults(jo.ppd);
+		jo.num_options = cupsParseOptions(argv[5], 0, &jo.options);
+		cupsMarkOptions(jo.ppd, jo.num_options, jo.options);
 
-		char *value = ppd_get(ppd, "NewDocInfo");
+		char *value = ppd_get(&jo, "NewDocInfo");
 		if (!strcmp(value, "1"))
 			new_doc_info = true;
-		value = ppd_get(ppd, "Compression");
-		if (!strcmp(value, "G4"))
-			compression = COMPRESS_G4;
+	}
+	tuning_parse(&jo);
+	if (!strcmp(ppd_get(&jo, "Compression"), "G4"))
+		flt.compression = COMPRESS_G4;
+	if (!strcmp(ppd_get(&jo, "MaxCompression"), "ON"))
+		flt.max_compression = true;
+	num_threads = encoder_threads(tuning_get(&jo, "EncoderThreads"));
+	flt.g4_strip_lines = atoi(ppd_get(&jo, "G4StripHeight"));	/* "Page" = 0 */
+	flt.strip_budget = atoi(ppd_get(&jo, "StripBudget"));	/* "Fixed" = 0 */
+	/* strip cache size in KB, off if not set ("Off" = 0) */
+	int strip_cache_kb = atoi(tuning_get(&jo, "StripCache"));
+	flt.use_strip_cache = flt.compression == COMPRESS_CANON && !flt.strip_budget && strip_cache_kb > 0;
+	output_init(&flt.out, fileno(stdout));
+	/* read, encode and write in separate threads, only if enabled */
+	pipeline = !strcmp(tuning_get(&jo, "Pipeline"), "ON");
+	if (pipeline) {
+		/* mapped input is read in place, reader thread would only add a copy */
+		if (!input.map)
+			src.queue = &flt.reader;
+		if ((src.queue && reader_start(&flt.reader, &input)) || writer_start(&flt.out)) {
+			fprintf(stderr, "Unable to start pipeline threads\n");
+			return 2;
+		}
+	}
+	if (!src.queue)
+		src = input;
+	if (num_threads > 1 && (flt.compression == COMPRESS_CANON || flt.g4_strip_lines) && strip_pool_start(&flt.pool, num_threads)) {
+		fprintf(stderr, "Unable to start encoder threads\n");
+		return 2;
+	}
+	if (carps_stream_init(&flt.stream, flt.max_compression, flt.strip_budget)) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 2;
+	}
+	if (flt.compression == COMPRESS_G4)
+		carps_stream_g4(&flt.stream, flt.g4_strip_lines);
+	if (flt.use_strip_cache && (carps_strip_cache_init(&flt.strip_cache, (size_t)strip_cache_kb * 1024) ||
+				    carps_stream_cache(&flt.stream, &flt.strip_cache))) {
+		fprintf(stderr, "Memory allocation error\n");
+		return 2;
 	}
 
-	if (new_doc_info)
-		write_doc_info_new(buf, pbm_mode ? "Untitled" : argv[3], pbm_mode ? "root" : argv[2], pbm_mode ? 0 : time(NULL));
-	else
-		write_doc_info(buf, pbm_mode ? "Untitled" : argv[3], pbm_mode ? "root" : argv[2], pbm_mode ? 0 : time(NULL));
-
-	/* begin 1 */
-	memset(buf, 0, 4);
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_BEGIN1, buf, 4, stdout);
-	/* begin 2 */
-	memset(buf, 0, 4);
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_BEGIN2, buf, 4, stdout);
-	/* print params - unknown  */
-	u8 unknown_param[] = { 0x00, 0x2e, 0x82, 0x00, 0x00 };
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_PARAMS, unknown_param, sizeof(unknown_param), stdout);
-	/* print params - image refinement */
-	params.magic = CARPS_PARAM_MAGIC;
-	params.param = CARPS_PARAM_IMAGEREFINE;
-	params.enabled = CARPS_PARAM_ENABLED;
+	job_stats_start(&flt.stats);
+	job.title = pbm_mode ? "Untitled" : argv[3];
+	job.user = pbm_mode ? "root" : argv[2];
+	job.timestamp = pbm_mode ? 0 : time(NULL);
+	job.new_doc_info = new_doc_info;
+	/* print params: image refinement and toner save */
+	job.image_refinement = CARPS_PARAM_ENABLED;
+	job.toner_save = CARPS_PARAM_DISABLED;
 	if (!pbm_mode) {
-		char *value = ppd_get(ppd, "ImageRefinement");
-		if (!strcmp(value, "OFF"))
-			params.enabled = CARPS_PARAM_DISABLED;
-	}
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_PARAMS, &params, sizeof(params), stdout);
-	/* print params - toner save */
-	params.magic = CARPS_PARAM_MAGIC;
-	params.param = CARPS_PARAM_TONERSAVE;
-	params.enabled = CARPS_PARAM_DISABLED;
-	if (!pbm_mode) {
-		char *value = ppd_get(ppd, "TonerSave");
-		if (strcmp(value, "DEFAULT")) {
-			if (!strcmp(value, "ON"))
-				params.enabled = CARPS_PARAM_ENABLED;
-			write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_PARAMS, &params, sizeof(params), stdout);
-		}
-	} else
-		write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_PARAMS, &params, sizeof(params), stdout);
+		if (!strcmp(ppd_get(&jo, "ImageRefinement"), "OFF"))
+			job.image_refinement = CARPS_PARAM_DISABLED;
+		char *value = ppd_get(&jo, "TonerSave");
+		if (!strcmp(value, "DEFAULT"))
+			job.toner_save = 0;
+		else if (!strcmp(value, "ON"))
+			job.toner_save = CARPS_PARAM_ENABLED;
+	}
+	carps_job_begin(job_block, &flt.out, &job);
 
 	if (!pbm_mode) {
-		while (cupsRasterReadHeader2(ras, &page_header)) {
+		while (input.map ? raster_map_header(input.map, &page_header) : cupsRasterReadHeader2(ras, &page_header)) {
 			page++;
 			fprintf(stderr, "PAGE: %d %d\n", page, page_header.NumCopies);
 
-			line_len_file = page_header.cupsBytesPerLine;
-			line_len = ROUND_UP_MULTIPLE(line_len_file, 4);
-			if (!cur_line) {
-				cur_line = malloc(line_len);
-				for (int i = 0; i < 8; i++)
-					last_lines[i] = malloc(line_len);
-			}
-			height = page_header.cupsHeight;
-			width = page_header.cupsWidth;
-			dpi = page_header.HWResolution[0];
-			DBG("line_len_file=%d,line_len=%d height=%d width=%d", line_len_file, line_len, height, width);
+			flt.line_len_file = page_header.cupsBytesPerLine;
+			flt.line_len = ROUND_UP_MULTIPLE(flt.line_len_file, 4);
+			input.line_len = src.line_len = flt.line_len;
+			input.line_len_file = src.line_len_file = flt.line_len_file;
+			flt.height = page_header.cupsHeight;
+			flt.width = page_header.cupsWidth;
+			flt.dpi = page_header.HWResolution[0];
+			DBG("line_len_file=%d,line_len=%d height=%d width=%d", flt.line_len_file, flt.line_len, flt.height, flt.width);
 			if (page == 1) {	/* print data header */
 				char *page_size_name = page_header.cupsPageSizeName;
 				/* get page size name from PPD if cupsPageSizeName is empty */
 				if (strlen(page_size_name) == 0)
-					page_size_name = ppd_get(ppd, "PageSize");
-				fill_print_data_header(buf, copies, dpi, page_header.cupsMediaType, page_size_name, page_header.PageSize[0], page_header.PageSize[1], compression);
-				write_block(CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, buf, strlen(buf), stdout);
+					page_size_name = ppd_get(&jo, "PageSize");
+				carps_fill_print_data_header(buf, copies, flt.dpi, page_header.cupsMediaType, page_size_name, page_header.PageSize[0], page_header.PageSize[1], flt.compression);
+				write_block(&flt.out, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, buf, strlen(buf));
 			}
 
+			if (src.queue && reader_request(&flt.reader, flt.height)) {
+				fprintf(stderr, "Memory allocation error\n");
+				return 2;
+			}
 			/* encode print data in strips */
-			while (height > 0)
-				height -= encode_strip(page, height, NULL, ras, compression);
+			flt.out.page = (struct page_stats) { .start = time_ns() };
+			if (flt.pool.num_threads)
+				encode_page_parallel(&flt, page, &src);
+			else
+				encode_page_stream(&flt, page, &src);
+			if (src.queue)
+				reader_finish(&flt.reader);
 			/* end of page */
-			u8 page_end[] = { 0x01, 0x0c };
-			write_block(CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, page_end, sizeof(page_end), stdout);
+			write_page_end(&flt.out, page);
+			page_done(&flt, page);
 		}
 	} else {
 		/* print data header */
-		fill_print_data_header(buf, 1, 600, WEIGHT_PLAIN, "A4", 0, 0, COMPRESS_CANON);	/* 1 copy, 600 dpi, plain paper, A4 */
-		write_block(CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, buf, strlen(buf), stdout);
+		carps_fill_print_data_header(buf, 1, 600, WEIGHT_PLAIN, "A4", 0, 0, flt.compression);	/* 1 copy, 600 dpi, plain paper, A4 */
+		write_block(&flt.out, CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, buf, strlen(buf));
+		if (src.queue && reader_request(&flt.reader, flt.height)) {
+			fprintf(stderr, "Memory allocation error\n");
+			return 2;
+		}
 		/* encode print data in strips */
-		while (!feof(f) && height > 0)
-			height -= encode_strip(1, height, f, NULL, compression);
+		flt.out.page = (struct page_stats) { .start = time_ns() };
+		if (flt.pool.num_threads)
+			encode_page_parallel(&flt, 1, &src);
+		else
+			encode_page_stream(&flt, 1, &src);
+		if (src.queue)
+			reader_finish(&flt.reader);
 		/* end of page */
-		u8 page_end[] = { 0x01, 0x0c };
-		write_block(CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, page_end, sizeof(page_end), stdout);
+		write_page_end(&flt.out, 1);
+		page_done(&flt, 1);
 	}
 	if (pbm_mode)
 		fclose(f);
 	else {
-		ppdClose(ppd);
-		cupsRasterClose(ras);
-	}
-	/* end of print data */
-	u8 print_data_end[] = { 0x01, 0x1b, 'P', '0', 'J', 0x1b, '\\' };
-	write_block(CARPS_DATA_PRINT, CARPS_BLOCK_PRINT, print_data_end, sizeof(print_data_end), stdout);
-	/* end of print data */
-	buf[0] = 1;
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_PRINT, buf, 1, stdout);
-	/* end 2 */
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_END2, NULL, 0, stdout);
-	/* end 1 */
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_END1, NULL, 0, stdout);
-	/* end of document */
-	buf[0] = 0;
-	write_block(CARPS_DATA_CONTROL, CARPS_BLOCK_END, buf, 1, stdout);
-
-	if (cur_line) {
-		free(cur_line);
-		for (int i = 0; i < 8; i++)
-			free(last_lines[i]);
+		ppdClose(jo.ppd);
+		if (ras)
+			cupsRasterClose(ras);
+		raster_map_close(&raster_map);
 	}
-
-	return 0;
+	carps_job_end(job_block, &flt.out);
+
+	if (pipeline) {
+		if (src.queue)
+			reader_stop(&flt.reader);
+		writer_stop(&flt.out);
+		LOG("reader: %llu ms reading input, %llu ms waiting for encoder",
+		    (unsigned long long)flt.reader.read_ns / 1000000, (unsigned long long)flt.reader.full_ns / 1000000);
+		LOG("encoder: %llu ms waiting for input, %llu ms waiting for writer",
+		    (unsigned long long)flt.reader.empty_ns / 1000000, (unsigned long long)flt.out.writer.full_ns / 1000000);
+		LOG("writer: %llu ms writing output, %llu ms waiting for encoder",
+		    (unsigned long long)flt.out.writer.write_ns / 1000000, (unsigned long long)flt.out.writer.idle_ns / 1000000);
+	}
+	/* blocks not written yet when not pipelined */
+	output_flush(&flt.out);
+	if (flt.pool.num_threads)
+		strip_pool_stop(&flt.pool);
+	job_done(&flt, argv[1], num_threads);
+
+	carps_stream_free(&flt.stream);
+	carps_strip_cache_free(&flt.strip_cache);
+	job_options_free(&jo);
+
+	/* output could not be written */
+	return flt.out.error ? 1 : 0;
 }
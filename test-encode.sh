@@ -1,8 +1,10 @@
 #!/bin/sh
 
+# options (second argument) are passed to the filter, G4 pages are decoded too
 test_encode() {
-	echo -n "$1: "
-	./rastertocarps $1.pbm- >$1.test 2>$1.out
+	echo -n "$1${2:+ [$2]}: "
+	./rastertocarps $1.pbm- "$2" >$1.test 2>$1.out
+	rm -f decoded-p1.pbm
 	./carps-decode $1.test >/dev/null
 	cmp $1.pbm decoded-p1.pbm
 	if [ "$?" = "0" ]; then
@@ -10,6 +12,35 @@ test_encode() {
 	fi
 }
 
+# page narrower than the @-80 offset (line_len < 80), seeded sparse random data: width must be a multiple of 32
+test_narrow() {
+	name=narrow$1
+	./pbmsample random $1 $1 64 $name.pbm- || return
+	tail -c $(($1 / 8 * 64)) $name.pbm- >$name.pbm
+	test_encode $name
+}
+
+# two fixed strips (1024 lines of 64 bytes) with the same line_hash: the strip cache must compare lines
+test_cache_collision() {
+	name=cache-collision
+	(head -c 65536 /dev/zero
+	 printf '\001\001\001\001\001\001\001\001'; head -c 24 /dev/zero
+	 printf '\010\035\170\077\207\161\265\223'; head -c $((65536 - 40 + 65536)) /dev/zero) >$name.pbm
+	(printf "P4\n512 3072\n"; cat $name.pbm) >$name.pbm-
+	test_encode $name StripCache=8192
+}
+
+# strips are planned on the same grid with and without encoder threads: output must be the same
+test_threads() {
+	echo -n "$1${2:+ $2} threads: "
+	./rastertocarps $1.pbm- "$2 EncoderThreads=1" >$1.test 2>$1.out
+	./rastertocarps $1.pbm- "$2 EncoderThreads=4" >$1.test4 2>>$1.out
+	cmp $1.test $1.test4
+	if [ "$?" = "0" ]; then
+		echo OK
+	fi
+}
+
 test_encode oneline
 test_encode web1
 test_encode testpage
@@ -20,3 +51,21 @@ test_encode screenshot
 test_encode waterlilies
 test_encode bluehills
 test_encode sunset
+test_narrow 32
+test_narrow 96
+test_narrow 608
+test_encode web1 Compression=G4
+test_encode web1 "Compression=G4 G4StripHeight=256"
+test_encode screenshot "Compression=G4 G4StripHeight=512"
+test_encode waterlilies-dither Compression=G4
+test_encode web1 MaxCompression=ON
+test_encode sunset-dither MaxCompression=ON
+test_encode web1 StripBudget=16384
+test_encode testpage StripBudget=4000
+test_encode web1 Pipeline=OFF
+test_encode web1 Pipeline=ON
+test_encode web1 StripCache=8192
+test_cache_collision
+test_threads web1
+test_threads web1 StripBudget=16384
+test_threads screenshot StripBudget=4000